@@ -0,0 +1,89 @@
+/* nsnake-bot-greedy: sample bot plugin.
+
+   Heads for the food by the shortest (wrap-aware in portal mode) step,
+   avoiding moves the reachable-space query reports as fatal or as traps.
+
+   build: make nsnake-bot-greedy.so
+   run:   ./nsnake --bot ./nsnake-bot-greedy.so
+ */
+
+/* Includes
+ **************/
+#include <stdlib.h>
+#include "nsnake-bot.h"
+
+
+/* Routines
+ *************/
+const int nsnake_bot_abi = NSNAKE_BOT_ABI;
+
+static const int dirs[] = {
+	NSNAKE_DIR_LEFT, NSNAKE_DIR_RIGHT, NSNAKE_DIR_UP, NSNAKE_DIR_DOWN,
+	NSNAKE_DIR_UP_LEFT, NSNAKE_DIR_UP_RIGHT, NSNAKE_DIR_DOWN_LEFT, NSNAKE_DIR_DOWN_RIGHT
+};
+static const int dx[] = { -1, 1, 0, 0, -1, 1, -1, 1 };
+static const int dy[] = { 0, 0, -1, 1, -1, -1, 1, 1 };
+
+/* Distance along one axis, through the border when portals are on */
+static int axis_dist(int a, int b, int size, int wrap)
+{
+	int d = abs(a - b);
+
+	if(wrap && size - d < d) {
+		d = size - d;
+	}
+	return d;
+}
+
+void *nsnake_bot_init(const NSNAKE_VIEW *view)
+{
+	return NULL;
+}
+
+int nsnake_bot_decide(void *bot, const NSNAKE_VIEW *view)
+{
+	int best = NSNAKE_DIR_NONE;
+	int best_score = -1;
+	int i, cur = 0, reach, x, y, dist, score;
+
+	for(i = 0; i < 8; i++) {
+		if(dirs[i] == view->dir) {
+			cur = i;
+		}
+	}
+
+	for(i = 0; i < 8; i++) {
+		/* Turning back reverses the snake or does nothing, skip it */
+		if(dx[i] == -dx[cur] && dy[i] == -dy[cur]) {
+			continue;
+		}
+		reach = view->reach(view, dirs[i]);
+		if( ! reach) {
+			continue;
+		}
+
+		/* Diagonal steps cover both axes at once */
+		x = view->head.x + dx[i];
+		y = view->head.y + dy[i];
+		dist = 0;
+		if(view->food_present) {
+			dist = axis_dist(x, view->food.x, view->width, view->portal);
+			if(axis_dist(y, view->food.y, view->height, view->portal) > dist) {
+				dist = axis_dist(y, view->food.y, view->height, view->portal);
+			}
+		}
+
+		/* Room to fit the snake first, then closeness to the food */
+		score = (reach >= view->length) * 0x10000 + 0xffff - dist;
+		if(score > best_score) {
+			best_score = score;
+			best = dirs[i];
+		}
+	}
+
+	return best;
+}
+
+void nsnake_bot_free(void *bot)
+{
+}
@@ -0,0 +1,101 @@
+/* nsnake-bot.h: interface for bot plugins, loaded with --bot path.so
+
+   A bot is a shared object exporting:
+
+     const int nsnake_bot_abi = NSNAKE_BOT_ABI;
+     void *nsnake_bot_init(const NSNAKE_VIEW *view);
+     int   nsnake_bot_decide(void *bot, const NSNAKE_VIEW *view);
+     void  nsnake_bot_free(void *bot);
+
+   init is called at the start of every game and returns the bot's own
+   state (may be NULL), which is handed back to decide and free. decide
+   is called once per tick and returns one of NSNAKE_DIR_*; NONE keeps
+   going straight. decide runs on the game thread and is never cut
+   short: the game waits for it, and a decision slower than
+   --bot-accept is then discarded as NONE.
+
+   The view points straight into the game's own state; it is only valid
+   during the call and must not be written to.
+ */
+#ifndef NSNAKE_BOT_H
+#define NSNAKE_BOT_H
+
+#define NSNAKE_BOT_ABI	1
+
+/* Directions, the same values as nsnake's direction_t */
+#define NSNAKE_DIR_NONE		0
+#define NSNAKE_DIR_LEFT		0xA000
+#define NSNAKE_DIR_RIGHT	0xA002
+#define NSNAKE_DIR_UP		0xA004
+#define NSNAKE_DIR_DOWN		0xA006
+#define NSNAKE_DIR_UP_LEFT	0xA008
+#define NSNAKE_DIR_UP_RIGHT	0xA00a
+#define NSNAKE_DIR_DOWN_LEFT	0xA00c
+#define NSNAKE_DIR_DOWN_RIGHT	0xA00e
+
+/* Level map cells; CELL_PORTAL + n is endpoint n of a portal pair */
+#define NSNAKE_CELL_FREE	0
+#define NSNAKE_CELL_WALL	1
+#define NSNAKE_CELL_PORTAL	2
+
+typedef struct nsnake_coord {
+	short x;
+	short y;
+} NSNAKE_COORD;
+
+typedef struct nsnake_view {
+	int abi;
+
+	/* Board of width x height cells, row-major. Cell 0 is at board
+	   coordinate (begx, begy); all coordinates below are board ones.
+	*/
+	int width;
+	int height;
+	int begx;
+	int begy;
+	const unsigned char *cells;	/* Level map, NSNAKE_CELL_* */
+	const unsigned char *occupied;	/* Body cells on each board cell */
+
+	/* Interactive games: the body as runs. Run i covers length[i]
+	   cells from (end_x, end_y) stepping (step_x, step_y) towards the
+	   head. Runs are in no particular order.
+	*/
+	int seg_count;
+	const short *seg_end_x;
+	const short *seg_end_y;
+	const short *seg_step_x;
+	const short *seg_step_y;
+	const short *seg_length;
+
+	/* Batch games: the body as a ring of body_cap cells, head at
+	   body_head and the tail length - 1 cells before it
+	*/
+	const NSNAKE_COORD *body;
+	int body_cap;
+	int body_head;
+
+	NSNAKE_COORD head;
+	int dir;
+	int length;
+	int score;
+	int ticks;
+	int food_present;
+	NSNAKE_COORD food;
+	int portal;
+	int reverse;
+	int cheat;
+	unsigned long long hash;	/* Zobrist hash of the state */
+
+	/* Free cells reachable after steering to dir and moving once,
+	   counted up to length: 0 is certain death, under length a trap
+	*/
+	int (*reach)(const struct nsnake_view *view, int dir);
+
+	void *host;			/* nsnake private */
+} NSNAKE_VIEW, *P_NSNAKE_VIEW;
+
+typedef void *(*nsnake_bot_init_fn)(const NSNAKE_VIEW *view);
+typedef int (*nsnake_bot_decide_fn)(void *bot, const NSNAKE_VIEW *view);
+typedef void (*nsnake_bot_free_fn)(void *bot);
+
+#endif
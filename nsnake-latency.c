@@ -0,0 +1,430 @@
+/* nsnake-latency: end-to-end input-to-screen latency harness.
+
+   Runs nsnake under a pseudo-terminal at every speed setting, sends
+   scripted steering keys and watches the output stream. For each key it
+   measures the time until the matching direction glyph of show_status()
+   is written ("status"), and until the snake is drawn one cell on from
+   its last head in the new direction ("move"). Snake cells are blanks
+   on the snake colour pair's red background; a small terminal model
+   follows the cursor to tell where they land.
+
+   usage: nsnake-latency [-n samples] [path/to/nsnake [args...]]
+ */
+
+/* Includes
+ **************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <pty.h>
+#include <sys/wait.h>
+
+
+/* Macros / Defnitions
+ ************************/
+#define MIN_SPEED	1
+#define MAX_SPEED	9
+#define DEFAULT_SAMPLES	10
+#define TERM_ROWS	24
+#define TERM_COLS	80
+#define STARTUP_MS	500
+#define TIMEOUT_MS	2000
+#define MAX_SAMPLES	1000
+#define MAX_ARGS	32
+
+/* Snake cells are drawn on a red background (COLOR_PAIR_SNAKE) */
+#define SNAKE_BG	41
+#define MAX_PARAMS	16
+
+/* Structures
+ *******************/
+typedef struct step {
+	char key;
+	char glyph;
+	int dy;			/* Head step once the turn is taken */
+	int dx;
+} STEP;
+
+/* Just enough of a terminal to follow the cursor and the background */
+typedef struct term {
+	int row;
+	int col;
+	bool snake_bg;
+	int state;		/* TERM_* */
+	int params[MAX_PARAMS];
+	int n_params;
+
+	int head_row;		/* Last snake cell drawn, 0 before any */
+	int head_col;
+	int want_dy;		/* Step that shows the turn was taken */
+	int want_dx;
+	bool turned;
+} TERM, *P_TERM;
+
+enum { TERM_TEXT, TERM_ESC, TERM_CSI, TERM_CHARSET };
+
+typedef struct samples {
+	int count;
+	int timeouts;
+	double status_ms[MAX_SAMPLES];
+	double move_ms[MAX_SAMPLES];
+} SAMPLES, *P_SAMPLES;
+
+/* Turns that never reverse the snake, so reverse mode stays out of it */
+static const STEP script[] = {
+	{ 'l', '<', 0, -1 }, { 'u', '^', -1, 0 }, { 'r', '>', 0, 1 }, { 'u', '^', -1, 0 }
+};
+
+/* Routines
+ *************/
+static double now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static int param(P_TERM pt, int i, int def)
+{
+	return i < pt->n_params && pt->params[i] ? pt->params[i] : def;
+}
+
+static void term_sgr(P_TERM pt)
+{
+	int i;
+
+	if( ! pt->n_params) {
+		pt->snake_bg = false;
+	}
+	for(i = 0; i < pt->n_params; i++) {
+		if(pt->params[i] == SNAKE_BG) {
+			pt->snake_bg = true;
+		}
+		else if(pt->params[i] == 0 || (pt->params[i] >= 40 && pt->params[i] <= 49)) {
+			pt->snake_bg = false;
+		}
+	}
+}
+
+static void term_csi(P_TERM pt, unsigned char final)
+{
+	switch(final) {
+		case 'H':
+		case 'f':
+			pt->row = param(pt, 0, 1);
+			pt->col = param(pt, 1, 1);
+			break;
+		case 'd':
+			pt->row = param(pt, 0, 1);
+			break;
+		case 'G':
+		case '`':
+			pt->col = param(pt, 0, 1);
+			break;
+		case 'A':
+			pt->row -= param(pt, 0, 1);
+			break;
+		case 'B':
+			pt->row += param(pt, 0, 1);
+			break;
+		case 'C':
+		case 'b':	/* Repeat the last character */
+			pt->col += param(pt, 0, 1);
+			break;
+		case 'D':
+			pt->col -= param(pt, 0, 1);
+			break;
+		case 'm':
+			term_sgr(pt);
+			break;
+	}
+}
+
+/* A blank on the snake background is a snake cell */
+static void term_put(P_TERM pt, unsigned char ch)
+{
+	if(ch == ' ' && pt->snake_bg) {
+		if(pt->head_row && pt->row - pt->head_row == pt->want_dy &&
+		   pt->col - pt->head_col == pt->want_dx) {
+			pt->turned = true;
+		}
+		pt->head_row = pt->row;
+		pt->head_col = pt->col;
+	}
+	pt->col++;
+}
+
+static void term_feed(P_TERM pt, const unsigned char *buf, ssize_t n)
+{
+	ssize_t i;
+	unsigned char ch;
+
+	for(i = 0; i < n; i++) {
+		ch = buf[i];
+		switch(pt->state) {
+			case TERM_ESC:
+				if(ch == '[') {
+					pt->state = TERM_CSI;
+					pt->n_params = 0;
+					memset(pt->params, 0, sizeof(pt->params));
+				}
+				else if(ch == '(' || ch == ')') {
+					pt->state = TERM_CHARSET;
+				}
+				else {
+					pt->state = TERM_TEXT;
+				}
+				continue;
+			case TERM_CHARSET:
+				pt->state = TERM_TEXT;
+				continue;
+			case TERM_CSI:
+				if(ch >= '0' && ch <= '9') {
+					if( ! pt->n_params) {
+						pt->n_params = 1;
+					}
+					pt->params[pt->n_params - 1] =
+						pt->params[pt->n_params - 1] * 10 + ch - '0';
+				}
+				else if(ch == ';') {
+					if( ! pt->n_params) {
+						pt->n_params = 1;
+					}
+					if(pt->n_params < MAX_PARAMS) {
+						pt->n_params++;
+					}
+				}
+				else if(ch >= 0x40 && ch <= 0x7e) {
+					term_csi(pt, ch);
+					pt->state = TERM_TEXT;
+				}
+				continue;
+		}
+
+		if(ch == 27) {
+			pt->state = TERM_ESC;
+		}
+		else if(ch == '\b') {
+			pt->col--;
+		}
+		else if(ch == '\r') {
+			pt->col = 1;
+		}
+		else if(ch == '\n') {
+			pt->row++;
+		}
+		else if(ch >= ' ' && ch != 0x7f) {
+			term_put(pt, ch);
+		}
+	}
+}
+
+/* Follow the output for ms milliseconds */
+static void drain(int fd, P_TERM pt, int ms)
+{
+	unsigned char buf[4096];
+	double end = now_ms() + ms;
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	ssize_t n;
+
+	while(now_ms() < end) {
+		if(poll(&pfd, 1, (int)(end - now_ms()) + 1) > 0) {
+			n = read(fd, buf, sizeof(buf));
+			if(n <= 0) {
+				return;
+			}
+			term_feed(pt, buf, n);
+		}
+	}
+}
+
+/* Send one key, then wait for its glyph and for the head to step the
+   new way. Returns false on timeout or if the game went away.
+*/
+static bool measure_key(int fd, P_TERM pt, const STEP *pstep, double *pstatus, double *pmove)
+{
+	unsigned char buf[4096];
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	double t_send, t_now;
+	bool seen_glyph = false, seen_move = false;
+	ssize_t n;
+
+	pt->want_dy = pstep->dy;
+	pt->want_dx = pstep->dx;
+	pt->turned = false;
+
+	t_send = now_ms();
+	if(write(fd, &pstep->key, 1) != 1) {
+		return false;
+	}
+
+	while((t_now = now_ms()) - t_send < TIMEOUT_MS) {
+		if(poll(&pfd, 1, TIMEOUT_MS) <= 0) {
+			continue;
+		}
+		n = read(fd, buf, sizeof(buf));
+		if(n <= 0) {
+			return false;
+		}
+		t_now = now_ms();
+		term_feed(pt, buf, n);
+
+		/* The turned head is usually drawn in the same refresh as the
+		   glyph (rows above the status bar come first), else later
+		*/
+		if( ! seen_glyph && memchr(buf, pstep->glyph, n)) {
+			seen_glyph = true;
+			*pstatus = t_now - t_send;
+		}
+		if( ! seen_move && pt->turned) {
+			seen_move = true;
+			*pmove = t_now - t_send;
+		}
+		if(seen_glyph && seen_move) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile(double *v, int n, int pct)
+{
+	int i = (n * pct + 99) / 100 - 1;
+
+	if(i < 0) {
+		i = 0;
+	}
+	return v[i];
+}
+
+static void report(int speed, P_SAMPLES ps)
+{
+	if( ! ps->count) {
+		printf("%5d  %7s  (no samples, %d timeouts)\n", speed, "-", ps->timeouts);
+		return;
+	}
+
+	qsort(ps->status_ms, ps->count, sizeof(double), cmp_double);
+	qsort(ps->move_ms, ps->count, sizeof(double), cmp_double);
+	printf("%5d  %7d  %7.1f %7.1f %7.1f   %7.1f %7.1f %7.1f %7.1f  %d\n",
+	       speed, ps->count,
+	       percentile(ps->status_ms, ps->count, 50),
+	       percentile(ps->status_ms, ps->count, 90),
+	       ps->status_ms[ps->count - 1],
+	       ps->move_ms[0],
+	       percentile(ps->move_ms, ps->count, 50),
+	       percentile(ps->move_ms, ps->count, 90),
+	       ps->move_ms[ps->count - 1],
+	       ps->timeouts);
+}
+
+/* Run one game at the given speed and collect nsamples measurements */
+static bool run_speed(char **argv, int argc, int speed, int nsamples, P_SAMPLES ps)
+{
+	struct winsize wsz = { TERM_ROWS, TERM_COLS, 0, 0 };
+	TERM term;
+	char speed_arg[16];
+	char *args[MAX_ARGS + 4];
+	pid_t pid;
+	int fd, i, n = 0;
+
+	snprintf(speed_arg, sizeof(speed_arg), "%d", speed);
+	for(i = 0; i < argc && i < MAX_ARGS; i++) {
+		args[n++] = argv[i];
+	}
+	args[n++] = "--speed";
+	args[n++] = speed_arg;
+	args[n] = NULL;
+
+	pid = forkpty(&fd, NULL, NULL, &wsz);
+	if(pid < 0) {
+		perror("forkpty");
+		return false;
+	}
+	if(pid == 0) {
+		setenv("TERM", "xterm", 1);
+		execv(args[0], args);
+		perror(args[0]);
+		_exit(127);
+	}
+
+	memset(ps, 0, sizeof(SAMPLES));
+	memset(&term, 0, sizeof(TERM));
+	term.row = term.col = 1;
+	drain(fd, &term, STARTUP_MS);
+
+	srandom(speed);
+	for(i = 0; i < nsamples && i < MAX_SAMPLES; i++) {
+		if(measure_key(fd, &term, &script[i % 4], &ps->status_ms[ps->count],
+			       &ps->move_ms[ps->count])) {
+			ps->count++;
+		}
+		else {
+			ps->timeouts++;
+		}
+		/* Land the next key at a random phase of the tick */
+		drain(fd, &term, 50 + random() % 250);
+	}
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	close(fd);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	char *default_cmd[] = { "./nsnake" };
+	char **cmd = default_cmd;
+	int cmd_argc = 1;
+	int nsamples = DEFAULT_SAMPLES;
+	int opt, speed;
+	SAMPLES samples;
+
+	while((opt = getopt(argc, argv, "+n:h")) != -1) {
+		switch(opt) {
+			case 'n':
+				nsamples = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "usage: nsnake-latency [-n samples] "
+					"[path/to/nsnake [args...]]\n");
+				return 1;
+		}
+	}
+	if(optind < argc) {
+		cmd = &argv[optind];
+		cmd_argc = argc - optind;
+	}
+
+	printf("input-to-output latency in ms, %d keys per speed\n", nsamples);
+	printf("%5s  %7s  %23s   %31s  %s\n", "", "",
+	       "---- status glyph ----", "------------ head move ------------", "");
+	printf("%5s  %7s  %7s %7s %7s   %7s %7s %7s %7s  %s\n",
+	       "speed", "samples", "p50", "p90", "max",
+	       "min", "p50", "p90", "max", "timeouts");
+
+	for(speed = MIN_SPEED; speed <= MAX_SPEED; speed++) {
+		if( ! run_speed(cmd, cmd_argc, speed, nsamples, &samples)) {
+			return 1;
+		}
+		report(speed, &samples);
+		fflush(stdout);
+	}
+
+	return 0;
+}
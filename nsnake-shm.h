@@ -0,0 +1,77 @@
+/* nsnake-shm.h: live game state published with --shm NAME
+
+   nsnake creates the POSIX shared memory object NAME and rewrites it
+   after every tick. Map it read-only and copy a consistent snapshot
+   with nsnake_shm_read(): the game never waits for readers, instead
+   seq is odd while an update is in progress and changes with every
+   update, so a reader that saw it move simply tries again.
+ */
+#ifndef NSNAKE_SHM_H
+#define NSNAKE_SHM_H
+
+#include <string.h>
+#include <stdatomic.h>
+
+#define NSNAKE_SHM_MAGIC	"NSSM"
+#define NSNAKE_SHM_VERSION	1
+
+typedef struct nsnake_shm {
+	char magic[4];
+	unsigned int version;
+	unsigned int size;		/* Bytes in the object, header included */
+	_Atomic unsigned int seq;	/* Odd while the game is writing */
+
+	/* Fixed for the whole game */
+	int width;
+	int height;
+	int begx;			/* Board coordinate of cell 0 */
+	int begy;
+
+	/* Rewritten every tick */
+	int running;			/* Cleared when the game ends */
+	int ticks;
+	int score;
+	int length;
+	int head_x;
+	int head_y;
+	int dir;			/* NSNAKE_DIR_* of nsnake-bot.h */
+	int food_present;
+	int food_x;
+	int food_y;
+	int speed;
+	int pause;
+	int portal;
+	int reverse;
+	int cheat;
+	unsigned long long hash;	/* Zobrist hash of the state */
+
+	/* width x height body cell counts, row-major */
+	unsigned char occupied[];
+} NSNAKE_SHM, *P_NSNAKE_SHM;
+
+/* Copy the header into *hdr and, if occ is not NULL, the body cells into
+   occ (width * height bytes). Returns the number of torn reads retried.
+*/
+static inline int nsnake_shm_read(const NSNAKE_SHM *shm, NSNAKE_SHM *hdr, unsigned char *occ)
+{
+	unsigned int s1, s2;
+	int retries = -1;
+
+	do {
+		retries++;
+		s1 = atomic_load_explicit(&shm->seq, memory_order_acquire);
+		if(s1 & 1) {
+			continue;
+		}
+		memcpy(hdr, shm, sizeof(NSNAKE_SHM));
+		if(occ) {
+			memcpy(occ, shm->occupied, shm->width * shm->height);
+		}
+		atomic_thread_fence(memory_order_acquire);
+		s2 = atomic_load_explicit(&shm->seq, memory_order_relaxed);
+	} while((s1 & 1) || s1 != s2);
+
+	return retries;
+}
+
+#endif
@@ -4,12 +4,35 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <errno.h>
 #include <unistd.h>
 #include <time.h>
 #include <assert.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <pthread.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <termios.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <dlfcn.h>
+#include <endian.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <ncurses.h>
 
+#include "nsnake-bot.h"
+#include "nsnake-shm.h"
+
 
 /* Macros / Defnitions
  ************************/
@@ -18,6 +41,10 @@
 #define DEFAULT_ERASE_CHAR  ' ' 
 #define DEFAULT_TRACE_CHAR '.'
 #define DEFAULT_FOOD_CHAR '@' 
+#define FOOD_TRIES	64	/* Random picks before scanning for a free cell */
+
+/* Trace mode draws visited cells from sparse to dense with these */
+#define HEATMAP_GLYPHS	".:-=+*%"
 
 #define MIN_SPEED	1
 #define MAX_SPEED	9
@@ -30,20 +57,134 @@
 #define COLOR_PAIR_SNAKE	3
 #define COLOR_PAIR_STATUS	4
 #define COLOR_PAIR_RED_ON_BLACK	5
+#define COLOR_PAIR_PORTAL	6
+#define COLOR_PAIR_COUNT	7
 
 #define STATUS_ATTR	  	(WA_BOLD | WA_UNDERLINE)
 #define STATUS_SPEED_AVAIL	(WA_BOLD)
 #define STATUS_BOLD_BLINK  	(WA_BOLD | WA_BLINK)
 
+/* All drawing goes through the selected renderer backend */
 //#define DRAW_CHAR(w, y, x, ch) mvwaddch(w, y, x, ch)
-#define DRAW_CHAR(w, y, x, ch) mvaddch(y, x, ch)
+#define DRAW_CHAR(w, y, x, ch) renderer->draw_char(y, x, ch)
+#define DRAW_MOVE(w, y, x)     renderer->cursor(y, x)
+#define DRAW_STR(s)            renderer->draw_str(s)
+#define DRAW_ATTRON(a)         renderer->attrib_on(a)
+#define DRAW_ATTROFF(a)        renderer->attrib_off(a)
+#define DRAW_REFRESH()         renderer->flush_frame()
 
 #define DRAW_SNAKE_HEAD(w, y, x, ch) { \
-	attron(COLOR_PAIR(COLOR_PAIR_SNAKE)); \
+	DRAW_ATTRON(COLOR_PAIR(COLOR_PAIR_SNAKE)); \
 	DRAW_CHAR(w, y, x, ch); \
-	attroff(COLOR_PAIR(COLOR_PAIR_SNAKE)); \
+	DRAW_ATTROFF(COLOR_PAIR(COLOR_PAIR_SNAKE)); \
 	}
 
+/* Raw ANSI renderer frame buffer: a frame is built in fixed chunks that
+   are emitted together with one writev()
+*/
+#define ANSI_CHUNK_LEN		(16 * 1024)
+#define ANSI_MAX_CHUNKS		16
+
+/* Render thread frame rate cap; the ready slot of its triple buffer
+   carries FRAME_FRESH while it holds a frame not yet taken
+*/
+#define DEFAULT_FPS		60
+#define FRAME_FRESH		4
+
+/* Collision map cell types.
+   A cell value of CELL_PORTAL + n denotes endpoint n of the level's
+   portal table; endpoints 2k and 2k+1 form a pair.
+*/
+#define CELL_FREE	0
+#define CELL_WALL	1
+#define CELL_PORTAL	2
+#define MAX_PORTAL_ENDPOINTS	(256 - CELL_PORTAL)
+
+#define DEFAULT_WALL_CHAR   '#'
+#define DEFAULT_PORTAL_CHAR 'O'
+
+/* Sound queue depth and per-event minimum spacing */
+#define SOUND_QUEUE_LEN		16
+#define SOUND_EAT_INTERVAL	(ONE_MILLI_SECOND * 150)
+
+/* Keyboard ring capacity (power of two) and input thread poll period */
+#define INPUT_RING_LEN		64
+#define INPUT_POLL_MS		100
+
+/* Telemetry ring capacity (power of two) and writer idle poll */
+#define TELEMETRY_RING_LEN	65536
+#define TELEMETRY_IDLE_USEC	2000
+
+/* Rewind history: ops kept (power of two), how far one key press goes */
+#define HISTORY_LEN		8192
+#define REWIND_SECONDS		1
+
+/* HIST_SETTING flags, and the HIST_TIMER flag bit for a pending timer */
+#define HIST_SET_PORTAL		0
+#define HIST_SET_CHEAT		1
+#define HIST_SET_REVERSE	2
+#define HIST_TIMER_PENDING	0x80
+
+/* Timer wheel: TIMER_LEVELS levels of TIMER_SLOTS slots, each level
+   TIMER_SLOTS times coarser than the one below
+*/
+#define TIMER_LEVELS		4
+#define TIMER_SLOT_BITS		6
+#define TIMER_SLOTS		(1 << TIMER_SLOT_BITS)
+#define TIMER_SPAN		(1ULL << (TIMER_LEVELS * TIMER_SLOT_BITS))
+
+/* Speed steps gained for --boost-ticks after eating */
+#define BOOST_SPEED		3
+
+/* Default time a bot decision may take and still be used, in usec.
+   Decisions run to completion on the game thread; this only decides
+   whether the answer counts.
+*/
+#define DEFAULT_BOT_ACCEPT	1000
+
+/* Zobrist key kinds; keys are derived from (kind, x, y) on the fly */
+#define ZOBRIST_BODY		1
+#define ZOBRIST_HEAD		2
+#define ZOBRIST_DIR		3
+#define ZOBRIST_FOOD		4
+#define ZOBRIST_SETTINGS	5
+
+/* Segment store arrays grow in whole SIMD vectors */
+#define SEGSTORE_LANES	8
+
+/* Level file format (all fields little-endian):
+     LEVEL_HEADER
+     n_portals x LEVEL_PORTAL  (level relative endpoint coordinates)
+     n_runs    x LEVEL_RUN     (row-major run-length coded walls)
+*/
+#define LEVEL_MAGIC	"NSLV"
+#define LEVEL_VERSION	1
+#define LEVEL_SRC_COLS	1022	/* Longest --compile-level source line */
+#define LEVEL_SRC_ROWS	1024
+
+/* High-score files (native byte order):
+     PATH      SCORE_HEADER, then SCORE_ENTRY records, append only
+     PATH.idx  SCORE_HEADER, then one SCORE_KEY per indexed record,
+               sorted by profile, score (highest first), record number
+*/
+#define SCORES_MAGIC		"NSHS"
+#define SCORES_INDEX_MAGIC	"NSHI"
+#define SCORES_VERSION		1
+#define SCORES_TOP		10
+#define SCORES_BATCH		1024	/* Entries buffered per append */
+#define SCORES_TAIL_MAX		65536	/* Unindexed records before a reindex */
+
+/* Spectator stream (native byte order):
+     STREAM_HEADER
+     STREAM_FRAME, n_runs x STREAM_RUN   per refresh that changed a cell
+   A run skips cells (row-major, from where the previous run ended) and
+   sets count cells to one value; a value of 0 is a cell never drawn.
+   The first frame covers every cell.
+*/
+#define STREAM_MAGIC		"NSST"
+#define STREAM_VERSION		1
+#define STREAM_RUN_MAX		0xffff
+
 /* enums
  ***********/
  typedef enum  { 
@@ -57,17 +198,90 @@
 		DIR_DOWN_RIGHT = 0xA00e
 	} direction_t;
 
+typedef enum {
+		SOUND_EAT = 0,
+		SOUND_GAME_OVER,
+		SOUND_EVENT_COUNT
+	} sound_event_t;
+
+typedef enum {
+		TERM_NONE = 0,
+		TERM_WALL,
+		TERM_OBSTACLE,
+		TERM_SELF,
+		TERM_MEMORY,
+		TERM_USER,
+		TERM_BOARD_FULL
+	} term_cause_t;
+
+/* Rewind history ops, each undoable in O(1) but for a reversal, which
+   walks the segments and is allowed once per tick
+*/
+typedef enum {
+		HIST_TICK = 0,		/* A snake_move() starts here */
+		HIST_HEAD_PUSH,		/* New head segment in front of the old one */
+		HIST_HEAD_REPLACE,	/* Empty head swapped out; keeps its dir, coord */
+		HIST_HEAD_GROW,		/* Head gained a cell; flag: coord_start moved */
+		HIST_TAIL_SHRINK,	/* Tail lost a cell, coord_end moved */
+		HIST_TAIL_FREE,		/* Tail lost its last cell; keeps dir, coord */
+		HIST_REVERSE,
+		HIST_EAT,
+		HIST_FOOD,		/* Food placed; keeps old coord, flag: old b_eaten */
+		HIST_SETTING,		/* Toggled; flag: HIST_SET_*, value: old state */
+		HIST_SPEED,		/* Speed changed; value: old speed */
+		HIST_BOOST,		/* Boost delta changed; value: old delta */
+		HIST_WHEEL,		/* Game timer wheel advanced a tick */
+		HIST_TIMER		/* Game timer armed, cancelled or fired; flag: id,
+					   HIST_TIMER_PENDING; value: ticks it had left */
+	} hist_op_t;
+
+typedef enum {
+		GAME_TIMER_FOOD = 0,
+		GAME_TIMER_BOOST,
+		GAME_TIMER_PORTAL
+	} game_timer_t;
+
 /* Structures
  *******************/
+typedef struct coord {
+        NCURSES_SIZE_T x;	
+        NCURSES_SIZE_T y;	
+} COORD, *P_COORD;
+
+typedef struct level {
+	int width;
+	int height;
+	unsigned char *cells;	/* Collision map, one byte per board cell */
+	int n_portals;
+	COORD portals[MAX_PORTAL_ENDPOINTS];
+} LEVEL, *P_LEVEL;
+
 typedef struct snake_window {
        NCURSES_SIZE_T _maxy, _maxx;
        NCURSES_SIZE_T _begy, _begx;
+       P_LEVEL plevel;
 } WINDOW_SNAKE, *P_WINDOW_SNAKE;
 
-typedef struct coord {
-        NCURSES_SIZE_T x;	
-        NCURSES_SIZE_T y;	
-} COORD, *P_COORD;
+typedef struct level_header {
+	char magic[4];
+	unsigned char version;
+	unsigned char n_portals;
+	unsigned short width;
+	unsigned short height;
+	unsigned short reserved;
+	unsigned int n_runs;
+} LEVEL_HEADER;
+
+typedef struct level_portal {
+	unsigned short x;
+	unsigned short y;
+} LEVEL_PORTAL;
+
+typedef struct level_run {
+	unsigned short count;
+	unsigned char cell;
+	unsigned char reserved;
+} LEVEL_RUN;
 
 typedef struct snake_segment {
 	struct snake_segment *next;
@@ -76,17 +290,68 @@ typedef struct snake_segment {
 	int length;
 	COORD coord_start;
 	COORD coord_end;
+	int slot;		/* Index in the snake's SEG_STORE */
 } SSEG, *P_SSEG;
 
+/* Structure-of-arrays mirror of the segment list used for hit testing.
+   A segment covers 'length' cells, starting at its tail-most cell
+   (end_x, end_y) and walking (step_x, step_y) towards its head.
+   Slots past 'count' are padded with zero-length runs that never hit.
+*/
+typedef struct seg_store {
+	int count;
+	int capacity;
+	short *end_x;
+	short *end_y;
+	short *step_x;
+	short *step_y;
+	short *length;
+	P_SSEG *owner;
+} SEG_STORE, *P_SEG_STORE;
+
+/* Incremental state hash. Body cells are XORed in and out one by one;
+   head/direction, food and settings each own a slot whose current key is
+   kept so it can be swapped out in O(1).
+*/
+typedef struct zobrist {
+	uint64_t hash;
+	uint64_t k_head;
+	uint64_t k_food;
+	uint64_t k_settings;
+} ZOBRIST, *P_ZOBRIST;
+
+/* Scratch for bounded flood fills: a cell is visited in the current fill
+   when its mark equals stamp, so nothing is cleared between fills
+*/
+typedef struct reach {
+	int cells;
+	unsigned int stamp;
+	unsigned int *mark;
+	COORD *queue;
+} REACH, *P_REACH;
+
 typedef struct snake {
 	int seg_count;
 	int score;
+	int length;		/* Cells in the body */
+	int ticks;		/* Moves made so far */
+	int reverse_tick;	/* ticks when last reversed, -1 none since */
 	bool term_wall_collision;
+	bool term_obstacle_collision;
 	bool term_self_collision;
 	bool term_mem_alloc_fail;
 	bool term_user_choice;
+	bool term_board_full;	/* No free cell left for the food */
 	P_SSEG seg_head;
 	P_SSEG seg_tail; 
+	SEG_STORE segs;
+	ZOBRIST zob;		/* State hash, current as of the last tick */
+	unsigned char *occupied;	/* Body cells on each board cell */
+	unsigned int *visits;	/* Times the head entered each board cell */
+	unsigned int visits_max;
+	REACH reach;
+	int reach_ahead;	/* Free cells reachable moving straight on */
+	bool trapped;		/* reach_ahead is less than length */
 } SNAKE , *P_SNAKE;
 
 typedef struct settings {
@@ -102,6 +367,9 @@ typedef struct settings {
 	chtype ch_food;
 	bool b_show_segcount;
 	bool b_show_length;
+	int food_ttl;		/* Ticks before uneaten food moves, 0 never */
+	int boost_ticks;	/* Ticks of extra speed after eating, 0 none */
+	int portal_ticks;	/* Ticks border portals stay open, 0 always */
 } SETTINGS, *P_SETTINGS;
 
 typedef struct food {
@@ -109,15 +377,350 @@ typedef struct food {
 	COORD coord;
 } FOOD, *P_FOOD; 
 
+/* Renderer backend. Coordinates are screen rows/columns, attributes are
+   ncurses attr_t values (COLOR_PAIR() and WA_* bits) for every backend.
+   init() sets up the screen, draws the frame box and fills in the board
+   geometry; out is the terminal when NULL.
+*/
+typedef struct renderer {
+	const char *name;
+	bool has_curses;	/* Draws through stdscr from the game thread,
+				   so wgetch() can stand in for the input thread */
+	bool (*init)(P_WINDOW_SNAKE p_ws, FILE *out);
+	void (*uninit)();
+	void (*cursor)(int y, int x);
+	void (*draw_char)(int y, int x, chtype ch);
+	void (*draw_str)(const char *str);
+	void (*attrib_on)(attr_t attr);
+	void (*attrib_off)(attr_t attr);
+	void (*flush_frame)();
+} RENDERER, *P_RENDERER;
+
+/* Lock-free single-producer/single-consumer ring of fixed size elements.
+   head is only written by the producer and tail only by the consumer;
+   capacity is a power of two so indices wrap with a mask.
+*/
+typedef struct spsc_ring {
+	_Alignas(64) atomic_uint head;
+	_Alignas(64) atomic_uint tail;
+	_Alignas(64) unsigned int mask;
+	size_t elem_size;
+	unsigned char *buf;
+} SPSC_RING, *P_SPSC_RING;
+
+typedef struct key_event {
+	int ch;
+	long long t_arrival;		/* usec, CLOCK_MONOTONIC */
+} KEY_EVENT, *P_KEY_EVENT;
+
+/* Keyboard reader thread feeding the game loop through a ring, plus
+   the input-to-move latency it makes measurable
+*/
+typedef struct input {
+	bool running;
+	atomic_bool quit;
+	pthread_t thread;
+	SPSC_RING ring;
+	atomic_llong dropped;		/* Keys lost to a full ring, counted by the thread */
+
+	long long lat_count;
+	long long lat_sum;
+	long long lat_max;
+	long long lat_last;
+} INPUT, *P_INPUT;
+
+/* Per-tick work time, in usec */
+typedef struct tick_stats {
+	long long count;
+	long long sum;
+	long long min;
+	long long max;
+} TICK_STATS, *P_TICK_STATS;
+
+/* One finished game, interactive or batch */
+typedef struct game_record {
+	long long time;			/* Wall clock, seconds */
+	bool batch;
+	int score;
+	int length;
+	int seg_count;
+	int ticks;
+	term_cause_t cause;
+	uint64_t hash;
+	bool portal;
+	bool reverse;
+	bool cheat;
+	int speed;
+	int board_width;
+	int board_height;
+
+	/* Interactive games only: batch games are stepped together, so they
+	   have no tick times of their own and leave these out of the log
+	*/
+	long long tick_min_us;
+	double tick_avg_us;
+	long long tick_max_us;
+} GAME_RECORD, *P_GAME_RECORD;
+
+typedef struct stream_header {
+	char magic[4];
+	unsigned char version;
+	unsigned char reserved;
+	unsigned short rows;
+	unsigned short cols;
+	unsigned short reserved2;
+} STREAM_HEADER;
+
+typedef struct stream_frame {
+	unsigned int time_ms;		/* Since the stream started */
+	unsigned int n_runs;
+} STREAM_FRAME, *P_STREAM_FRAME;
+
+typedef struct stream_run {
+	unsigned short skip;
+	unsigned short count;
+	unsigned int cell;		/* chtype with its attributes */
+} STREAM_RUN, *P_STREAM_RUN;
+
+typedef struct score_header {
+	char magic[4];
+	unsigned int version;
+	unsigned long long count;	/* Index only: records it covers */
+} SCORE_HEADER;
+
+typedef struct score_entry {
+	long long time;
+	unsigned long long hash;
+	unsigned int profile;		/* See scores_profile() */
+	int score;
+	int length;
+	int ticks;
+	unsigned char cause;
+	unsigned char batch;
+	unsigned char reserved[6];
+} SCORE_ENTRY, *P_SCORE_ENTRY;
+
+typedef struct score_key {
+	unsigned int profile;
+	int score;
+	unsigned int record;
+} SCORE_KEY, *P_SCORE_KEY;
+
+/* Games are buffered and appended under an exclusive flock(), so any
+   number of nsnake processes can share one store
+*/
+typedef struct scores {
+	bool running;
+	char *path;
+	char *idx_path;
+	char *tmp_path;
+	int fd;
+	SCORE_ENTRY *pending;
+	int n_pending;			/* Kept until a write succeeds */
+	long long dropped;		/* Games lost while the buffer was stuck full */
+	bool has_profile;
+	unsigned int profile;		/* Of the last game submitted */
+	SCORE_ENTRY last;
+} SCORES, *P_SCORES;
+
+/* Finished games are pushed into a ring and written out by a background
+   thread, so logging never blocks a game loop
+*/
+typedef struct telemetry {
+	bool running;
+	atomic_bool quit;
+	bool csv;
+	FILE *fp;
+	pthread_t thread;
+	SPSC_RING ring;
+	long long written;
+	long long dropped;
+} TELEMETRY, *P_TELEMETRY;
+
+typedef struct hist_op {
+	unsigned char op;
+	unsigned char flag;
+	direction_t dir;
+	union {
+		COORD coord;	/* Board ops */
+		int value;	/* Setting and timer ops */
+	};
+} HIST_OP, *P_HIST_OP;
+
+/* Ring of ops; head and tail run freely and are masked on access. When
+   full, the oldest whole tick is dropped so the ring always starts at a
+   tick boundary.
+*/
+typedef struct history {
+	bool enabled;
+	bool replaying;		/* Undoing, do not record */
+	struct game_timers *timers;	/* Rewound along with the board */
+	HIST_OP *ops;
+	unsigned int head;
+	unsigned int tail;
+} HISTORY, *P_HISTORY;
+
+/* A pending timer sits on a circular list in one wheel slot, so adding
+   and cancelling it is O(1) and a tick only touches the slot due
+*/
+typedef struct timer TIMER, *P_TIMER;
+typedef void (*timer_fn_t)(P_TIMER ptimer);
+
+struct timer {
+	P_TIMER next;		/* NULL when not pending */
+	P_TIMER prev;
+	unsigned long long expires;	/* Tick it fires on */
+	timer_fn_t fn;
+	void *arg;
+};
+
+typedef struct timer_wheel {
+	unsigned long long now;
+	TIMER slots[TIMER_LEVELS][TIMER_SLOTS];	/* List heads */
+} TIMER_WHEEL, *P_TIMER_WHEEL;
+
+/* Timed mechanics of an interactive game */
+typedef struct game_timers {
+	TIMER_WHEEL wheel;
+	TIMER food;		/* Uneaten food moves elsewhere */
+	TIMER boost;		/* Speed boost wears off */
+	TIMER portal;		/* Border portals close */
+	int boost_delta;	/* Speed steps the running boost added */
+	WINDOW_SNAKE *ws;
+	P_SETTINGS pset;
+	P_SNAKE psnake;
+	P_FOOD pfood;
+} GAME_TIMERS, *P_GAME_TIMERS;
+
+/* Sound events are queued by the game thread and played by a helper
+   thread, so a slow terminal bell never stalls a tick.
+*/
+typedef struct sound {
+	bool running;
+	bool quit;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	sound_event_t queue[SOUND_QUEUE_LEN];
+	int q_head;
+	int q_count;
+	long long last_queued[SOUND_EVENT_COUNT];	/* usec, for rate limiting */
+} SOUND, *P_SOUND;
+
+/* Lockstep batch of headless games for bot training and evaluation.
+   All games share one board geometry, collision map and rule settings.
+   Per game state lives in parallel arrays indexed by game number; the
+   body of game g is a ring of 'cells' coordinates at body[g * cells].
+*/
+typedef struct batch_env {
+	int n_games;
+	int cells;			/* Cells per board, also ring capacity */
+	WINDOW_SNAKE ws;
+	SETTINGS settings;
+
+	/* Per game state */
+	int *head;			/* Ring index of the head cell */
+	int *length;
+	int *score;
+	int *ticks;
+	direction_t *dir;
+	unsigned int *rng;
+	COORD *body;			/* n_games x cells */
+	unsigned char *body_dir;	/* Segment direction code of each body cell */
+	unsigned char *occupied;	/* n_games x cells body cell counts */
+	unsigned int *visits;		/* cells, summed over every game */
+
+	/* Observations, rewards and done flags of the last batch_step() */
+	short *head_x;
+	short *head_y;
+	short *food_x;
+	short *food_y;
+	float *reward;
+	unsigned char *done;
+	int *final_score;		/* Score of the game that just finished */
+
+	/* Totals since creation */
+	long long games_finished;
+	long long steps;
+	P_ZOBRIST zob;			/* Per game state hash */
+	REACH reach;			/* Shared flood fill scratch */
+} BATCH_ENV, *P_BATCH_ENV;
+
+/* A loaded bot plugin and its decision timing */
+typedef struct bot {
+	void *dl;
+	nsnake_bot_init_fn init;
+	nsnake_bot_decide_fn decide;
+	nsnake_bot_free_fn free;
+	double accept;			/* Slowest answer used, seconds */
+	long long decisions;
+	long long late;			/* Slower than accept, discarded */
+	double time_sum;
+	double time_max;
+} BOT, *P_BOT;
+
+/* One game a bot plays: its view, its state and where the view points */
+typedef struct bot_seat {
+	NSNAKE_VIEW view;
+	void *state;
+	WINDOW_SNAKE *ws;
+	P_SETTINGS pset;
+	P_SNAKE psnake;
+	P_FOOD pfood;
+	P_BATCH_ENV penv;
+	int g;
+} BOT_SEAT, *P_BOT_SEAT;
+
+/* Live state published to a POSIX shared memory object */
+typedef struct shm_export {
+	char *name;
+	P_NSNAKE_SHM map;
+	size_t size;
+	int cells;
+} SHM_EXPORT, *P_SHM_EXPORT;
+
+typedef struct options {
+	char *level_path;
+	char *compile_src;
+	char *compile_dst;
+	char *bench;
+	int bench_size;
+	int batch_games;
+	int batch_steps;
+	int board_width;
+	int board_height;
+	int speed;
+	char *renderer;
+	char *telemetry_path;
+	char *bot_path;
+	int bot_accept;
+	bool render_thread;
+	int fps;
+	char *shm_name;
+	char *scores_path;
+	int food_ttl;
+	int boost_ticks;
+	int portal_ticks;
+	char *stream_path;
+	char *view_path;
+	char *heatmap_path;
+} OPTIONS, *P_OPTIONS;
+
 /* Prototypes
  ****************/
-WINDOW* ncurses_init(P_WINDOW_SNAKE p_ws);
+WINDOW* ncurses_init(P_WINDOW_SNAKE p_ws, FILE *out);
 void ncurses_uninit();
 
+P_RENDERER renderer_find(const char *name);
+void frame_setup(P_RENDERER out, int fps);
+bool stream_setup(P_RENDERER out, const char *path);
+int run_view(P_OPTIONS popt);
+
 void init_settings(P_SETTINGS pset);
 P_SNAKE snake_init(WINDOW_SNAKE *ws);
 void free_snake(P_SNAKE psnake);
 void snake_draw_init(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake);
+void snake_erase_cell(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake, P_COORD pc);
 
 bool snake_move(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake, P_FOOD pfood);
 bool snake_steer(WINDOW_SNAKE *ws, P_SETTINGS pset,  P_SNAKE psnake, direction_t dir);
@@ -125,26 +728,167 @@ bool place_food(WINDOW_SNAKE *ws , P_SETTINGS pset, P_FOOD pfood, P_SNAKE psnake
 bool eat_food(P_SETTINGS pset, P_SNAKE psnake, P_FOOD pfood);
 bool is_self_collision(P_SETTINGS pset, P_SNAKE psnake);
 P_SSEG generate_new_head(direction_t newdir, P_COORD newcoord);
-void insert_new_head(P_SNAKE psnake, P_SSEG pnewhead);
+bool insert_new_head(P_SNAKE psnake, P_SSEG pnewhead);
+
+bool process_char(int ch, WINDOW_SNAKE *ws, P_SETTINGS psettings, P_SNAKE psnake, P_FOOD pfood);
+
+bool bot_load(const char *path, int accept_usec);
+void bot_unload();
+bool bot_loaded();
+void bot_seat_snake(P_BOT_SEAT seat, WINDOW_SNAKE *ws, P_SETTINGS pset,
+		    P_SNAKE psnake, P_FOOD pfood);
+void bot_seat_batch(P_BOT_SEAT seat, P_BATCH_ENV penv, int g);
+void bot_seat_free(P_BOT_SEAT seat);
+direction_t bot_decide(P_BOT_SEAT seat);
+
+bool shm_export_open(const char *name, WINDOW_SNAKE *ws);
+void shm_export_publish(P_SETTINGS pset, P_SNAKE psnake, P_FOOD pfood);
+void shm_export_close();
+
+void timer_wheel_init(P_TIMER_WHEEL tw);
+void timer_init(P_TIMER pt, timer_fn_t fn, void *arg);
+void timer_add(P_TIMER_WHEEL tw, P_TIMER pt, unsigned long long ticks);
+void timer_add_at(P_TIMER_WHEEL tw, P_TIMER pt, unsigned long long expires);
+void timer_cancel(P_TIMER pt);
+bool timer_pending(P_TIMER pt);
+int timer_wheel_tick(P_TIMER_WHEEL tw);
+void game_timers_init(P_GAME_TIMERS pgt, WINDOW_SNAKE *ws, P_SETTINGS pset,
+		      P_SNAKE psnake, P_FOOD pfood);
+void game_timers_tick(P_GAME_TIMERS pgt, bool ate);
+int game_timers_base_speed(P_GAME_TIMERS pgt);
+void game_timers_undo(P_GAME_TIMERS pgt, P_HIST_OP pop);
+void game_timers_resync(P_GAME_TIMERS pgt);
 
-bool process_char(int ch, WINDOW_SNAKE *ws, P_SETTINGS psettings, P_SNAKE psnake);
+bool history_init(P_GAME_TIMERS pgt);
+void history_free();
+void history_record(hist_op_t op, int flag, direction_t dir, P_COORD pc);
+void history_value(hist_op_t op, int flag, int value);
+bool history_last(hist_op_t op);
+bool history_cancel(hist_op_t op);
+int history_rewind(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake, P_FOOD pfood, int ticks);
 
 bool is_coord_on_snake(P_COORD pc_inq, P_SNAKE psnake);
 void rank_coord(P_SSEG pseg, P_COORD *ppc_small, P_COORD *ppc_large);
 bool is_coord_on_seg(P_COORD pc_inq, P_SSEG pseg);
+bool is_coord_on_snake_list(P_COORD pc_inq, P_SNAKE psnake);
+
+bool segstore_init(P_SEG_STORE pstore);
+void segstore_free(P_SEG_STORE pstore);
+bool segstore_add(P_SEG_STORE pstore, P_SSEG pseg);
+void segstore_remove(P_SEG_STORE pstore, P_SSEG pseg);
+void segstore_sync(P_SEG_STORE pstore, P_SSEG pseg);
+int segstore_hit(P_SEG_STORE pstore, P_COORD pc, int skip_slot);
+int segstore_hit_scalar(P_SEG_STORE pstore, int from, P_COORD pc, int skip_slot);
+
+bool reach_init(P_REACH pr, int cells);
+void reach_free(P_REACH pr);
+bool reach_next(WINDOW_SNAKE *ws, P_SETTINGS pset, P_COORD from, direction_t dir, P_COORD pc);
+int reach_count(WINDOW_SNAKE *ws, P_SETTINGS pset, P_REACH pr,
+		const unsigned char *occ, P_COORD start, int limit);
+int snake_reach_dir(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake, direction_t dir);
+void snake_check_trap(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake);
+
+P_BATCH_ENV batch_create(int n_games, int width, int height,
+			 P_SETTINGS pset, const char *level_path);
+void batch_free(P_BATCH_ENV penv);
+int batch_reach_dir(P_BATCH_ENV penv, int g, direction_t dir);
+void batch_reset(P_BATCH_ENV penv, int g);
+void batch_step(P_BATCH_ENV penv, const direction_t *actions);
+int run_batch(P_OPTIONS popt);
+
+double bench_now();
+int run_bench(P_OPTIONS popt);
+int bench_segments(int nseg);
+int bench_render(int frames);
+int bench_timers(int n_timers);
 
 void get_border_portal_coord(WINDOW_SNAKE *ws, P_SNAKE psnake,P_COORD pc);
+void portal_coord(WINDOW_SNAKE *ws, direction_t dir, P_COORD phead_coord, P_COORD pc);
+bool is_coord_border(WINDOW_SNAKE *ws, P_COORD pcoord);
 
 void reverse_snake(P_SNAKE psnake);
 direction_t get_oppose_dir(direction_t dir);
 
 void show_status(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake);
 
-inline NCURSES_SIZE_T y2graph(WINDOW_SNAKE *ws, NCURSES_SIZE_T ysnake);
+bool parse_options(int argc, char *argv[], P_OPTIONS popt);
+
+bool spsc_init(P_SPSC_RING pring, size_t elem_size, unsigned int capacity);
+void spsc_free(P_SPSC_RING pring);
+bool spsc_push(P_SPSC_RING pring, const void *elem);
+bool spsc_pop(P_SPSC_RING pring, void *elem);
+
+long long now_usec();
+bool input_init();
+void input_uninit();
+bool input_next(P_KEY_EVENT pev);
+bool input_running();
+void input_record_latency(long long t_arrival);
+bool is_steer_key(int ch);
+void show_debug_stats(WINDOW_SNAKE *ws, P_SNAKE psnake);
+
+void tick_stats_add(P_TICK_STATS pts, long long usec);
+term_cause_t snake_term_cause(P_SNAKE psnake);
+const char *term_cause_name(term_cause_t cause);
+bool telemetry_open(const char *path);
+void telemetry_close();
+void telemetry_submit(const GAME_RECORD *prec);
+bool telemetry_enabled();
+
+unsigned int scores_profile(const GAME_RECORD *prec);
+bool scores_open(const char *path);
+void scores_close();
+void scores_submit(const GAME_RECORD *prec);
+bool scores_flush(bool fold);
+int scores_top(unsigned int profile, P_SCORE_ENTRY top, int n);
+bool scores_enabled();
+
+void heatmap_setup(const char *path);
+void heatmap_draw(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake, P_FOOD pfood);
+bool heatmap_write(const unsigned int *visits, int width, int height);
+
+bool sound_init();
+void sound_uninit();
+void sound_play(sound_event_t event);
+
+bool level_init(WINDOW_SNAKE *ws);
+void level_free(WINDOW_SNAKE *ws);
+bool level_load(WINDOW_SNAKE *ws, const char *path);
+bool level_compile(const char *src_path, const char *dst_path);
+void level_draw(WINDOW_SNAKE *ws);
+void level_draw_cell(WINDOW_SNAKE *ws, int y, int x, unsigned char cell);
+unsigned char level_cell(WINDOW_SNAKE *ws, P_COORD pc);
+bool level_portal_exit(WINDOW_SNAKE *ws, unsigned char cell, P_COORD pc);
+
+static inline NCURSES_SIZE_T y2graph(WINDOW_SNAKE *ws, NCURSES_SIZE_T ysnake);
+static inline int board_index(WINDOW_SNAKE *ws, P_COORD pc);
+
+static inline uint64_t zobrist_key(int kind, int x, int y);
+static inline void zobrist_toggle(P_ZOBRIST pz, P_COORD pc);
+void zobrist_head(P_ZOBRIST pz, P_COORD pc, direction_t dir);
+void zobrist_food(P_ZOBRIST pz, P_COORD pc);
+void zobrist_settings(P_ZOBRIST pz, P_SETTINGS pset);
+uint64_t snake_hash_full(P_SNAKE psnake, P_SETTINGS pset, P_FOOD pfood);
+
+extern RENDERER renderer_ncurses;
+extern RENDERER renderer_ansi;
+extern RENDERER renderer_frame;
+extern RENDERER renderer_stream;
+static P_RENDERER renderer = &renderer_ncurses;
+
+/* Foreground and background of each color pair, shared by all backends */
+static const short color_pairs[COLOR_PAIR_COUNT][2] = {
+	[COLOR_PAIR_BOX]         = { COLOR_CYAN,    COLOR_BLACK },
+	[COLOR_PAIR_FOOD]        = { COLOR_GREEN,   COLOR_BLACK },
+	[COLOR_PAIR_SNAKE]       = { COLOR_WHITE,   COLOR_RED   },
+	[COLOR_PAIR_STATUS]      = { COLOR_WHITE,   COLOR_BLACK },
+	[COLOR_PAIR_RED_ON_BLACK]= { COLOR_RED,     COLOR_BLACK },
+	[COLOR_PAIR_PORTAL]      = { COLOR_MAGENTA, COLOR_BLACK },
+};
 
 /* Routines
  *************/
-int main()
+int main(int argc, char *argv[])
 {
 	WINDOW *w=NULL;
 	WINDOW_SNAKE ws;
@@ -153,23 +897,142 @@ int main()
 	FOOD food;
 	int ch = 0;
 	SETTINGS settings;
+	OPTIONS opt;
+	KEY_EVENT kev;
+	long long t_steer = 0;
+	long long t_tick;
+	TICK_STATS tick_stats = { 0, 0, 0, 0 };
+	GAME_RECORD rec;
+	BOT_SEAT seat;
+	direction_t bot_dir;
+	GAME_TIMERS timers;
+	int ret = 1;
+	char why[256] = "";		/* Shown once the screen is gone */
+
+	/* Parse command line */
+	if( ! parse_options(argc, argv, &opt)) {
+		return 1;
+	}
+
+	if(opt.compile_src) {
+		return level_compile(opt.compile_src, opt.compile_dst) ? 0 : 1;
+	}
+
+	if(opt.view_path) {
+		return run_view(&opt);
+	}
+
+	if(opt.telemetry_path && ! telemetry_open(opt.telemetry_path)) {
+		perror(opt.telemetry_path);
+		return 1;
+	}
+
+	if(opt.bench) {
+		ret = run_bench(&opt);
+		goto out;
+	}
+
+	if(opt.scores_path && ! scores_open(opt.scores_path)) {
+		perror(opt.scores_path);
+		goto out;
+	}
+
+	heatmap_setup(opt.heatmap_path);
+
+	if(opt.bot_path && ! bot_load(opt.bot_path, opt.bot_accept)) {
+		goto out;
+	}
+
+	if(opt.batch_games) {
+		ret = run_batch(&opt);
+		goto out;
+	}
 
 	/* Initialize game's default settings */
 	init_settings(&settings);
+	if(opt.speed) {
+		settings.speed = opt.speed;
+	}
+	settings.food_ttl = opt.food_ttl;
+	settings.boost_ticks = opt.boost_ticks;
+	settings.portal_ticks = opt.portal_ticks;
+	srandom(time(NULL));
+
+	renderer = renderer_find(opt.renderer);
+	if( ! renderer) {
+		fprintf(stderr, "nsnake: unknown renderer '%s'\n", opt.renderer);
+		goto out;
+	}
+
+	/* Draw from a thread of its own, fed with frame snapshots */
+	if(opt.render_thread) {
+		frame_setup(renderer, opt.fps);
+		renderer = &renderer_frame;
+	}
+
+	/* Tee what is drawn into the spectator stream */
+	if(opt.stream_path) {
+		if( ! stream_setup(renderer, opt.stream_path)) {
+			perror(opt.stream_path);
+			goto out;
+		}
+		renderer = &renderer_stream;
+	}
+
+	/* Initialize the screen */
+	if( ! renderer->init(&ws, NULL)) {
+		fprintf(stderr, "nsnake: could not initialize the screen\n");
+		goto out;
+	}
+	w = stdscr;
+
+	/* Start the sound helper; sound_play() beeps inline without it */
+	sound_init();
+
+	/* Start the keyboard thread; fall back to wgetch() without it,
+	   which only a renderer drawing through curses can offer
+	*/
+	if( ! input_init() && ! renderer->has_curses) {
+		snprintf(why, sizeof(why), "nsnake: could not start the input thread");
+		goto out_screen;
+	}
 
-	/* Initialize ncurses */
-	w = ncurses_init(&ws);
+	/* Set up the collision map and merge level walls into it */
+	if( ! level_init(&ws)) {
+		goto out_screen;
+	}
+	if(opt.level_path && ! level_load(&ws, opt.level_path)) {
+		snprintf(why, sizeof(why), "nsnake: could not load level '%s'",
+			 opt.level_path);
+		goto out_level;
+	}
 	
 	/* Initialize the snake structure */
 	psnake = snake_init(&ws);
 	if( ! psnake ) {
-		ncurses_uninit();
-		return 1;
+		goto out_level;
+	}
+
+	zobrist_settings(&psnake->zob, &settings);
+
+	/* Rewind works without it, just not very far */
+	history_init(&timers);
+
+	game_timers_init(&timers, &ws, &settings, psnake, &food);
+
+	if(bot_loaded()) {
+		bot_seat_snake(&seat, &ws, &settings, psnake, &food);
 	}
 
-	/* Draw the initial snake */
+	if(opt.shm_name && ! shm_export_open(opt.shm_name, &ws)) {
+		snprintf(why, sizeof(why), "%s: %s", opt.shm_name, strerror(errno));
+		goto out_game;
+	}
+
+	/* Draw the level and the initial snake */
+	level_draw(&ws);
 	snake_draw_init(&ws, &settings, psnake);
-	wrefresh(w);
+	DRAW_REFRESH();
 
 	/* main loop */
 	food.b_eaten = true;
@@ -179,81 +1042,215 @@ int main()
 			show_status(&ws, &settings, psnake);
 		}
 
-		if(food.b_eaten) {
-			place_food(&ws, &settings, &food ,psnake);
+		if(food.b_eaten && ! place_food(&ws, &settings, &food ,psnake)) {
+			break;
 		}
 
 		usleep((MAX_SPEED - settings.speed + 1) * DELAY_DELTA);
 
+		/* Drain keys queued during the sleep before this tick's move; a
+		   steering key ends the drain so that quick successive turns
+		   each get their own move
+		*/
+		if(input_next(&kev)) {
+			ch = 0;
+			while(kev.ch != ERR) {
+				ch = tolower(kev.ch);
+				process_char(ch, &ws, &settings, psnake, &food);
+				if(ch == 'x') {
+					psnake->term_user_choice = true;
+					break;
+				}
+				if(is_steer_key(ch)) {
+					t_steer = kev.t_arrival;
+					break;
+				}
+				input_next(&kev);
+			}
+			if(ch == 'x') {
+				break;
+			}
+		}
+
 		if(!settings.pause) {
+			if(bot_loaded()) {
+				bot_dir = bot_decide(&seat);
+				if(bot_dir && bot_dir != psnake->seg_head->dir) {
+					snake_steer(&ws, &settings, psnake, bot_dir);
+					settings.b_altered = true;
+				}
+			}
+			t_tick = now_usec();
 			if(!snake_move(&ws, &settings, psnake, &food)) {
 				break;
 			}
+			game_timers_tick(&timers, food.b_eaten);
+			snake_check_trap(&ws, &settings, psnake);
+			tick_stats_add(&tick_stats, now_usec() - t_tick);
+			if(t_steer) {
+				input_record_latency(t_steer);
+				t_steer = 0;
+			}
+		}
+
+		shm_export_publish(&settings, psnake, &food);
+
+#ifdef DEBUG
+		assert(psnake->zob.hash == snake_hash_full(psnake, &settings, &food));
+		show_debug_stats(&ws, psnake);
+#endif
+
+		if( ! input_running()) {
+			/* No input thread, poll ncurses (this also refreshes) */
+			ch = tolower(wgetch(w));
+			process_char(ch, &ws, &settings, psnake, &food);
+			if(ch == 'x')
+				psnake->term_user_choice = true;
+			continue;
 		}
 
-		ch = tolower(wgetch(w));
-		process_char(ch, &ws, &settings, psnake);
-		if(ch == 'x')
-			psnake->term_user_choice = true;
+		/* Show this tick's keys with its move rather than a tick later */
+		if(settings.b_altered) {
+			show_status(&ws, &settings, psnake);
+		}
+		DRAW_REFRESH();
+	}
+
+	input_uninit();
+	shm_export_close();
+	heatmap_write(psnake->visits, ws.plevel->width, ws.plevel->height);
+
+	if(telemetry_enabled() || scores_enabled()) {
+		memset(&rec, 0, sizeof(rec));
+		rec.time = time(NULL);
+		rec.score = psnake->score;
+		rec.length = psnake->length;
+		rec.seg_count = psnake->seg_count;
+		rec.ticks = psnake->ticks;
+		rec.cause = snake_term_cause(psnake);
+		rec.hash = psnake->zob.hash;
+		rec.portal = settings.portal;
+		rec.reverse = settings.reverse;
+		rec.cheat = settings.cheat;
+		rec.speed = game_timers_base_speed(&timers);
+		rec.board_width = ws.plevel->width;
+		rec.board_height = ws.plevel->height;
+		rec.tick_min_us = tick_stats.min;
+		rec.tick_avg_us = tick_stats.count ? (double)tick_stats.sum / tick_stats.count : 0;
+		rec.tick_max_us = tick_stats.max;
+		telemetry_submit(&rec);
+		scores_submit(&rec);
 	}
 
 	show_status(&ws, &settings, psnake);
-	wrefresh(w);
+	DRAW_REFRESH();
 	if(settings.sound) {
-		beep();
+		sound_play(SOUND_GAME_OVER);
 	}
 
 	sleep(5);
-	
-	
-	/* Uninitialize ncurses library */
-	ncurses_uninit();
+	ret = 0;
 
+	/* Unwind in the reverse order of setup; failed starts join in at
+	   the step after the last one that succeeded
+	*/
+out_game:
 	/* Free all snake segments and snake structure */
+	if(bot_loaded()) {
+		bot_seat_free(&seat);
+	}
 	free_snake(psnake);
+	history_free();
 
-	printf("Hope you enjoyed...\n");
-	return 0;
+out_level:
+	level_free(&ws);
+
+out_screen:
+	/* Stop the keyboard thread, drain and stop the sound helper */
+	input_uninit();
+	sound_uninit();
+
+	/* Uninitialize the screen */
+	renderer->uninit();
+	if(why[0]) {
+		fprintf(stderr, "%s\n", why);
+	}
+
+out:
+	/* Flush the game log and show the table this game went into */
+	bot_unload();
+	telemetry_close();
+	scores_close();
+
+	if( ! ret && psnake) {
+		printf("Hope you enjoyed...\n");
+	}
+	return ret;
 }
 
+/* Returns false, with the game ended, when no free cell is left */
 bool place_food(WINDOW_SNAKE *ws , P_SETTINGS pset, P_FOOD pfood, P_SNAKE psnake)
 {
-	long int rnd = 0;
 	P_COORD pcoord = &pfood->coord;
-
-	pfood->b_eaten = false;
-
-	srandom(time(NULL));		
+	COORD c;
+	int tries, i, cells;
 
 	/* Generate random location to place the food.
  	   If the random location turns out to be on snake's body
-	   regenerate location
+	   regenerate location. A level can leave few free cells or
+	   none, so after a while scan for one as batch_place_food() does.
 	*/
-	do {
-		pcoord->y = random() % (ws->_maxy);  
-		pcoord->x = random() % (ws->_maxx);  
-	} while(is_coord_on_snake(pcoord, psnake) || 
-		pcoord->x < ws->_begx || 
-	        pcoord->y < ws->_begy);
+	for(tries = 0; tries < FOOD_TRIES; tries++) {
+		c.y = random() % (ws->_maxy);  
+		c.x = random() % (ws->_maxx);  
+		if(c.x >= ws->_begx &&
+		   c.y >= ws->_begy &&
+		   level_cell(ws, &c) == CELL_FREE &&
+		   ! psnake->occupied[board_index(ws, &c)]) {
+			break;
+		}
+	}
+	if(tries == FOOD_TRIES) {
+		cells = ws->plevel->width * ws->plevel->height;
+		for(i = 0; i < cells; i++) {
+			if(ws->plevel->cells[i] == CELL_FREE && ! psnake->occupied[i]) {
+				break;
+			}
+		}
+		if(i == cells) {
+			psnake->term_board_full = true;
+			return false;
+		}
+		c.x = ws->_begx + i % ws->plevel->width;
+		c.y = ws->_begy + i / ws->plevel->width;
+	}
+
+	history_record(HIST_FOOD, pfood->b_eaten, 0, pcoord);
+	pfood->b_eaten = false;
+	*pcoord = c;
+	zobrist_food(&psnake->zob, pcoord);
 
 	/* Now draw the food */
-	attron(COLOR_PAIR(COLOR_PAIR_FOOD));
+	DRAW_ATTRON(COLOR_PAIR(COLOR_PAIR_FOOD));
 	DRAW_CHAR(ws, pcoord->y, pcoord->x, pset->ch_food);
-	attroff(COLOR_PAIR(COLOR_PAIR_FOOD));
+	DRAW_ATTROFF(COLOR_PAIR(COLOR_PAIR_FOOD));
+	return true;
 }
 
-bool process_char(int ch, WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake)
+bool process_char(int ch, WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake, P_FOOD pfood)
 {
 	switch(ch) 
 	{
 		case '-':	
 			if ( (pset->speed - 1) >= MIN_SPEED) {
+				history_value(HIST_SPEED, 0, pset->speed);
 				pset->speed--;
 				pset->b_altered = true;
 			}
 			break;	
 		case '+':
 			if ( (pset->speed + 1) <= MAX_SPEED ) {
+				history_value(HIST_SPEED, 0, pset->speed);
 				pset->speed++;
 				pset->b_altered = true;
 			}
@@ -263,21 +1260,35 @@ bool process_char(int ch, WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake)
 			pset->b_altered = true;
 			break;
 		case 'o':
+			history_value(HIST_SETTING, HIST_SET_PORTAL, pset->portal);
 			pset->portal = pset->portal ? false: true;
+			zobrist_settings(&psnake->zob, pset);
 			pset->b_altered = true;
 			break;
 		case 'c':
+			history_value(HIST_SETTING, HIST_SET_CHEAT, pset->cheat);
 			pset->cheat = pset->cheat ? false: true;
+			zobrist_settings(&psnake->zob, pset);
 			pset->b_altered = true;
 			break;
 		case 'v':
+			history_value(HIST_SETTING, HIST_SET_REVERSE, pset->reverse);
 			pset->reverse = pset->reverse ? false: true;
+			zobrist_settings(&psnake->zob, pset);
 			pset->b_altered = true;
 			break;
 		case 's':
 			pset->sound = pset->sound ? false: true;
 			pset->b_altered = true;
 			break;
+		case 'b':
+			/* Step back a second of play and pause there */
+			history_rewind(ws, pset, psnake, pfood, REWIND_SECONDS * 
+				       ONE_MILLI_SECOND * 1000 /
+				       ((MAX_SPEED - pset->speed + 1) * DELAY_DELTA));
+			pset->pause = true;
+			pset->b_altered = true;
+			break;
 		case 'l':
 		case KEY_LEFT:
 			snake_steer(ws, pset, psnake, DIR_LEFT);
@@ -317,8 +1328,12 @@ bool process_char(int ch, WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake)
 			pset->ch_erase = (pset->ch_erase == DEFAULT_ERASE_CHAR) ? 
                                            DEFAULT_TRACE_CHAR :
 				           DEFAULT_ERASE_CHAR;
+			heatmap_draw(ws, pset, psnake, pfood);
 			pset->b_altered = true;
 			break;
+		case 'm':
+			heatmap_write(psnake->visits, ws->plevel->width, ws->plevel->height);
+			break;
 		case 'g':
 			pset->b_show_segcount = pset->b_show_segcount ? false : true; 
 			if(pset->b_show_segcount) 
@@ -384,9 +1399,11 @@ bool seg_update_tailxy(P_SSEG seg)
 
 bool is_border(WINDOW_SNAKE *ws, P_SNAKE psnake)
 {
-	P_SSEG head = psnake->seg_head;
-	P_COORD pcoord = &head->coord_start;
+	return is_coord_border(ws, &psnake->seg_head->coord_start);
+}
 
+bool is_coord_border(WINDOW_SNAKE *ws, P_COORD pcoord)
+{
 	if(pcoord->x >= ws->_begx && 
  	   pcoord->x <= ws->_maxx &&
 	   pcoord->y >= ws->_begy &&
@@ -407,8 +1424,12 @@ bool snake_steer(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake, direction_t
 		return true;
 	}
 	
+	/* A second reversal in one tick is dropped unless it undoes the
+	   first, so a rewind undoes at most one per tick
+	*/
 	if(new_dir == get_oppose_dir(curr_dir)) {
-		if( pset->reverse) {
+		if( pset->reverse && (psnake->reverse_tick != psnake->ticks ||
+				      history_last(HIST_REVERSE))) {
 			reverse_snake(psnake);	
 		}
 		return true;
@@ -421,8 +1442,10 @@ bool snake_steer(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake, direction_t
 	seg_update_tailxy(pnewhead);
 	
 	/* Make new segment the head of the snake */
-	insert_new_head(psnake, pnewhead);
-
+	if( ! insert_new_head(psnake, pnewhead)) {
+		return false;
+	}
+	zobrist_head(&psnake->zob, &pnewhead->coord_start, new_dir);
 	return true;
 }
 
@@ -447,29 +1470,39 @@ P_SSEG generate_new_head(direction_t newdir, P_COORD newcoord)
 
 }
 
-void insert_new_head(P_SNAKE psnake, P_SSEG pnewhead)
+bool insert_new_head(P_SNAKE psnake, P_SSEG pnewhead)
 {
+	if( ! segstore_add(&psnake->segs, pnewhead)) {
+		free(pnewhead);
+		return false;
+	}
+
 	/* First perform pointer surgeries on
            all involved nodes/segments and
            increment segment count
         */
 	pnewhead->previous = NULL;
 	if( psnake->seg_head->length) {
+		history_record(HIST_HEAD_PUSH, 0, 0, NULL);
 		pnewhead->next = psnake->seg_head;
 		psnake->seg_head->previous = pnewhead;
 		psnake->seg_count++;
 	} 
 	else {
+		history_record(HIST_HEAD_REPLACE, 0, psnake->seg_head->dir,
+			       &psnake->seg_head->coord_start);
 		pnewhead->next = psnake->seg_head->next;
 		if(pnewhead->next) {
 			pnewhead->next->previous = pnewhead;
 		}
+		segstore_remove(&psnake->segs, psnake->seg_head);
 		free(psnake->seg_head);
 	}
 	
 	/* Now designate the new head
         */
 	psnake->seg_head = pnewhead;
+	return true;
 }
 
 bool eat_food(P_SETTINGS pset, P_SNAKE psnake, P_FOOD pfood)
@@ -480,10 +1513,12 @@ bool eat_food(P_SETTINGS pset, P_SNAKE psnake, P_FOOD pfood)
 	if(coord_head->y == coord_food->y &&
 	   coord_head->x == coord_food->x) {
 		pfood->b_eaten = true;
+		history_record(HIST_EAT, 0, 0, NULL);
+		zobrist_food(&psnake->zob, NULL);
 		psnake->score++;
 		pset->b_altered = true; 
 		if(pset->sound) {
-			beep();
+			sound_play(SOUND_EAT);
 		}
 		return true;
 	}
@@ -492,6 +1527,12 @@ bool eat_food(P_SETTINGS pset, P_SNAKE psnake, P_FOOD pfood)
 }
 
 bool is_coord_on_snake(P_COORD pc_inq, P_SNAKE psnake)
+{
+	return segstore_hit(&psnake->segs, pc_inq, -1) >= 0;
+}
+
+/* Original list walk, kept as the baseline for bench_segments() */
+bool is_coord_on_snake_list(P_COORD pc_inq, P_SNAKE psnake)
 {
 	P_SSEG head = psnake->seg_head;
 	P_SSEG eachseg = NULL;
@@ -510,7 +1551,6 @@ bool is_self_collision(P_SETTINGS pset, P_SNAKE psnake)
 {
 	P_SSEG head = psnake->seg_head;
 	P_COORD pc_inq = &head->coord_start;
-	P_SSEG eachseg = NULL;
 
 	if(pset->cheat) {
 		return false;
@@ -520,21 +1560,22 @@ bool is_self_collision(P_SETTINGS pset, P_SNAKE psnake)
 		return false;
 	}
 
-	eachseg = head->next;
-	while(eachseg) {
-		if(is_coord_on_seg(pc_inq, eachseg))
-			return true;
-		eachseg = eachseg->next;
-	}
-
-	return false;	
+	/* The head segment cannot cross itself, test all the others */
+	return segstore_hit(&psnake->segs, pc_inq, head->slot) >= 0;
 }
 
 void get_border_portal_coord(WINDOW_SNAKE *ws, P_SNAKE psnake,P_COORD pc)
 {
 	P_SSEG head = psnake->seg_head;
-	direction_t dir = head->dir;
-	P_COORD phead_coord = &head->coord_start;
+
+	portal_coord(ws, head->dir, &head->coord_start, pc);
+}
+
+/* Where a head at phead_coord moving in dir reappears after leaving
+   the board through a portal border
+*/
+void portal_coord(WINDOW_SNAKE *ws, direction_t dir, P_COORD phead_coord, P_COORD pc)
+{
 	NCURSES_SIZE_T x, y, a, b;
 
 	switch(dir) {
@@ -656,6 +1697,12 @@ bool snake_move(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake, P_FOOD pfood)
 		    	pset->b_show_length ? head->length + '0'  : pset->ch_draw;	
 	P_SSEG pnewhead = NULL;
 	COORD newcoord = {0,0};
+	unsigned char cell;
+	bool moved = true;
+	int i;
+
+	history_record(HIST_TICK, 0, 0, NULL);
+	psnake->ticks++;
 
 	/* Advance head's x,y (do not draw yet) */
 	seg_update_headxy(head);
@@ -683,8 +1730,39 @@ bool snake_move(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake, P_FOOD pfood)
 			psnake->term_mem_alloc_fail = true;
 			return false;
 		}
-		insert_new_head(psnake, pnewhead);
+		if( ! insert_new_head(psnake, pnewhead)) {
+			psnake->term_mem_alloc_fail = true;
+			return false;
+		}
+		head = pnewhead;
+		moved = false;
+	}
+
+	/* Consult the collision map for level obstacles and portals */
+	cell = level_cell(ws, &head->coord_start);
+	if(cell == CELL_WALL) {
+		psnake->term_obstacle_collision = true;
+		return false;
+	}
+	if(cell >= CELL_PORTAL) {
+		/* Entering a level portal, snake appears at its pair. A head
+		   just created by the border portal was never advanced.
+		*/
+		if(moved) {
+			seg_unupdate_headxy(head);
+		}
+		level_portal_exit(ws, cell, &newcoord);
+		pnewhead = generate_new_head(head->dir, &newcoord);
+		if( ! pnewhead) {
+			psnake->term_mem_alloc_fail = true;
+			return false;
+		}
+		if( ! insert_new_head(psnake, pnewhead)) {
+			psnake->term_mem_alloc_fail = true;
+			return false;
+		}
 		head = pnewhead;
+		moved = false;
 	}
 
 	/* Check if snake hs collided with itself */ 
@@ -698,7 +1776,17 @@ bool snake_move(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake, P_FOOD pfood)
                	head->coord_start.y, 
                 head->coord_start.x, 
 		ch);
+	history_record(HIST_HEAD_GROW, moved, 0, NULL);
 	head->length++;
+	psnake->length++;
+	segstore_sync(&psnake->segs, head);
+	zobrist_toggle(&psnake->zob, &head->coord_start);
+	zobrist_head(&psnake->zob, &head->coord_start, head->dir);
+	i = board_index(ws, &head->coord_start);
+	psnake->occupied[i]++;
+	if(++psnake->visits[i] > psnake->visits_max) {
+		psnake->visits_max = psnake->visits[i];
+	}
 
 	/* Check if there was food at the new head position */
 	if(eat_food(pset, psnake, pfood)) {
@@ -711,22 +1799,29 @@ bool snake_move(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake, P_FOOD pfood)
 	/* Actually draw advancement of the tail.
            Really this step clears (undraws) the very last character of the snake
         */
-	DRAW_CHAR(ws, tail->coord_end.y, tail->coord_end.x, pset->ch_erase);
+	snake_erase_cell(ws, pset, psnake, &tail->coord_end);
+	zobrist_toggle(&psnake->zob, &tail->coord_end);
+	psnake->occupied[board_index(ws, &tail->coord_end)]--;
 	tail->length--;
+	psnake->length--;
 
 
 	/* If tail segment has finished, designate previous segment
            to be the new tail - and free the old tail
 	*/
 	if ( tail->length == 0 ) {
+		history_record(HIST_TAIL_FREE, 0, tail->dir, &tail->coord_end);
 		psnake->seg_tail = tail->previous;	
 		psnake->seg_tail->next = NULL;
 		psnake->seg_count--;
+		segstore_remove(&psnake->segs, tail);
 		free(tail);
 	} 
 	else {
 		/*  Advance tail's x,y (do not draw) */
+		history_record(HIST_TAIL_SHRINK, 0, 0, NULL);
 		seg_update_tailxy(tail);
+		segstore_sync(&psnake->segs, tail);
 	}
 
 	return true;
@@ -753,6 +1848,8 @@ P_SNAKE snake_init(WINDOW_SNAKE *ws)
 {
 	P_SNAKE psnake = NULL;
 	P_SSEG p_initseg = NULL;
+	COORD c;
+	int i, cells;
 
 	psnake = calloc(sizeof(SNAKE),1);
 	if( ! psnake) {
@@ -764,6 +1861,21 @@ P_SNAKE snake_init(WINDOW_SNAKE *ws)
 		free(psnake);
 		return NULL;
 	}
+
+	if( ! segstore_init(&psnake->segs)) {
+		free(p_initseg);
+		free(psnake);
+		return NULL;
+	}
+
+	cells = ws->plevel->width * ws->plevel->height;
+	psnake->occupied = calloc(cells, 1);
+	psnake->visits = calloc(cells, sizeof(unsigned int));
+	if( ! psnake->occupied || ! psnake->visits || ! reach_init(&psnake->reach, cells)) {
+		free(p_initseg);
+		free_snake(psnake);
+		return NULL;
+	}
 	
 	/* TODO: Handle case where maxx/maxy of ncurses window
                  is not large enough to hold the initial size of
@@ -783,23 +1895,66 @@ P_SNAKE snake_init(WINDOW_SNAKE *ws)
 	/* Initialize snake */
 	psnake->seg_count = 1;
 	psnake->score = 0;
+	psnake->length = DEFAULT_INIT_LENGTH;
+	psnake->ticks = 0;
+	psnake->reverse_tick = -1;
 	psnake->term_wall_collision = false;
+	psnake->term_obstacle_collision = false;
 	psnake->term_self_collision = false;
 	psnake->term_mem_alloc_fail = false;
 	psnake->term_user_choice = false;
+	psnake->term_board_full = false;
 
 	/* Insert initial segment into the snake */
 	psnake->seg_head = p_initseg;
 	psnake->seg_tail = p_initseg;
+	segstore_add(&psnake->segs, p_initseg);
+
+	c = p_initseg->coord_end;
+	for(i = 0; i < p_initseg->length; i++) {
+		psnake->occupied[board_index(ws, &c)]++;
+		psnake->visits[board_index(ws, &c)]++;
+		seg_update_coord(p_initseg->dir, &c);
+	}
+	psnake->visits_max = 1;
+
+	/* Hash the initial body; settings and food are hashed when known */
+	psnake->zob.hash = snake_hash_full(psnake, NULL, NULL);
+	zobrist_head(&psnake->zob, &p_initseg->coord_start, p_initseg->dir);
 
 	return psnake;
 }
 
-void snake_draw_init(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake)
+/* Blank a cell the snake left, or in trace mode shade it by visits */
+void snake_erase_cell(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake, P_COORD pc)
 {
-	int i;
-	P_SSEG pseg = psnake->seg_head; 
-	NCURSES_SIZE_T y = pseg->coord_start.y;
+	const char glyphs[] = HEATMAP_GLYPHS;
+	unsigned char cell;
+	unsigned int v;
+
+	/* The snake may have crossed a portal exit, put it back */
+	cell = level_cell(ws, pc);
+	if(cell != CELL_FREE) {
+		level_draw_cell(ws, pc->y, pc->x, cell);
+		return;
+	}
+
+	if(pset->ch_erase != DEFAULT_TRACE_CHAR) {
+		DRAW_CHAR(ws, pc->y, pc->x, pset->ch_erase);
+		return;
+	}
+
+	v = psnake->visits[board_index(ws, pc)];
+	DRAW_CHAR(ws, pc->y, pc->x, v ? glyphs[(unsigned long long)(v - 1) *
+						 (sizeof(glyphs) - 1) / psnake->visits_max]
+				       : DEFAULT_ERASE_CHAR);
+}
+
+void snake_draw_init(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake)
+{
+	int i;
+	P_SSEG pseg = psnake->seg_head; 
+	NCURSES_SIZE_T y = pseg->coord_start.y;
 	NCURSES_SIZE_T x = pseg->coord_start.x;
 
 	for(i=0; i < pseg->length; i++, y++) {
@@ -807,11 +1962,21 @@ void snake_draw_init(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake)
 	}
 }
 
-WINDOW* ncurses_init(P_WINDOW_SNAKE p_ws)
+WINDOW* ncurses_init(P_WINDOW_SNAKE p_ws, FILE *out)
 {
 	WINDOW *w = NULL;
+	int i;
 	
-	w = initscr();
+	if(out) {
+		/* Off-screen output, e.g. for benchmarking */
+		if( ! newterm(getenv("TERM") ? getenv("TERM") : "xterm", out, stdin)) {
+			return NULL;
+		}
+		w = stdscr;
+	}
+	else {
+		w = initscr();
+	}
 	keypad(stdscr, TRUE);
 	cbreak();
 	noecho();
@@ -821,11 +1986,9 @@ WINDOW* ncurses_init(P_WINDOW_SNAKE p_ws)
 	curs_set(0);
 
 	start_color();
-	init_pair(COLOR_PAIR_BOX, COLOR_CYAN, COLOR_BLACK);
-	init_pair(COLOR_PAIR_FOOD, COLOR_GREEN, COLOR_BLACK);
-	init_pair(COLOR_PAIR_SNAKE, COLOR_WHITE, COLOR_RED);
-	init_pair(COLOR_PAIR_RED_ON_BLACK, COLOR_RED, COLOR_BLACK);
-	init_pair(COLOR_PAIR_STATUS, COLOR_WHITE, COLOR_BLACK);
+	for(i = 1; i < COLOR_PAIR_COUNT; i++) {
+		init_pair(i, color_pairs[i][0], color_pairs[i][1]);
+	}
 
 	/* Reserve space for key help */
 	attron(COLOR_PAIR(COLOR_PAIR_BOX));
@@ -926,6 +2089,10 @@ void free_snake(P_SNAKE psnake)
 		seg = next;
 	}
 
+	segstore_free(&psnake->segs);
+	reach_free(&psnake->reach);
+	free(psnake->occupied);
+	free(psnake->visits);
 	free(psnake);
 }
 
@@ -959,6 +2126,15 @@ void reverse_snake(P_SNAKE psnake)
 	P_SSEG seg = psnake->seg_head;
 	P_SSEG next = NULL;
 	COORD coord_temp;
+
+	/* Reversing straight back cancels the op and frees the tick's one */
+	if(history_cancel(HIST_REVERSE)) {
+		psnake->reverse_tick = -1;
+	}
+	else {
+		history_record(HIST_REVERSE, 0, 0, NULL);
+		psnake->reverse_tick = psnake->ticks;
+	}
 	
 	while(seg) 
 	{	
@@ -969,6 +2145,7 @@ void reverse_snake(P_SNAKE psnake)
 		coord_temp = seg->coord_start;
 		seg->coord_start = seg->coord_end;
 		seg->coord_end = coord_temp;
+		segstore_sync(&psnake->segs, seg);
 		seg = next;
 	}
 
@@ -976,6 +2153,9 @@ void reverse_snake(P_SNAKE psnake)
 	seg = psnake->seg_head;
 	psnake->seg_head = psnake->seg_tail;
 	psnake->seg_tail = seg; 
+
+	zobrist_head(&psnake->zob, &psnake->seg_head->coord_start,
+		     psnake->seg_head->dir);
 }
 
 void show_status(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake)
@@ -985,7 +2165,7 @@ void show_status(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake)
         char strbuff[100] ;
 	char dir_char=0;
 
-	move(ws->_maxy+1, ws->_begx);
+	DRAW_MOVE(ws, ws->_maxy+1, ws->_begx);
 	
 	/*
 	printw("head-len=%d, seg=%d, head @x,y = %d,%d, tail @x,y = %d,%d ", 
@@ -995,7 +2175,7 @@ void show_status(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake)
 		ptailc->x, ptailc->y);
 	*/
 
-	attron(COLOR_PAIR(COLOR_PAIR_STATUS));
+	DRAW_ATTRON(COLOR_PAIR(COLOR_PAIR_STATUS));
 	switch(psnake->seg_head->dir) {
 		case DIR_UP:
 			dir_char = '^';
@@ -1019,102 +2199,4724 @@ void show_status(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake)
 			break;
 	}
 	snprintf(strbuff,sizeof(strbuff),"%c",dir_char);
-	attron(COLOR_PAIR(COLOR_PAIR_RED_ON_BLACK) | STATUS_BOLD_BLINK);
-	addstr(strbuff);
-	attroff(COLOR_PAIR(COLOR_PAIR_RED_ON_BLACK) | STATUS_BOLD_BLINK);
+	DRAW_ATTRON(COLOR_PAIR(COLOR_PAIR_RED_ON_BLACK) | STATUS_BOLD_BLINK);
+	DRAW_STR(strbuff);
+	DRAW_ATTROFF(COLOR_PAIR(COLOR_PAIR_RED_ON_BLACK) | STATUS_BOLD_BLINK);
 	//addstr("   ");	
 	
 	//addstr("speed");
 	snprintf(strbuff, sizeof(strbuff), "%d", pset->speed);
-        addstr(strbuff);
-	addstr("(");
+        DRAW_STR(strbuff);
+	DRAW_STR("(");
 	if(pset->speed > MIN_SPEED)  
-		attron(STATUS_SPEED_AVAIL);
+		DRAW_ATTRON(STATUS_SPEED_AVAIL);
 	else
-		attroff(STATUS_SPEED_AVAIL);
-	addstr("-");
+		DRAW_ATTROFF(STATUS_SPEED_AVAIL);
+	DRAW_STR("-");
 	if(pset->speed < MAX_SPEED)
-		attron(STATUS_SPEED_AVAIL);
+		DRAW_ATTRON(STATUS_SPEED_AVAIL);
 	else
-		attroff(STATUS_SPEED_AVAIL);
-	addstr("+");
-	attroff(STATUS_SPEED_AVAIL);
-	addstr(")");
-	addstr("   ");	
+		DRAW_ATTROFF(STATUS_SPEED_AVAIL);
+	DRAW_STR("+");
+	DRAW_ATTROFF(STATUS_SPEED_AVAIL);
+	DRAW_STR(")");
+	if(psnake->trapped) {
+		/* Heading into a region too small to hold the snake */
+		DRAW_STR(" ");
+		DRAW_ATTRON(COLOR_PAIR(COLOR_PAIR_RED_ON_BLACK) | STATUS_BOLD_BLINK);
+		DRAW_STR("!");
+		DRAW_ATTROFF(COLOR_PAIR(COLOR_PAIR_RED_ON_BLACK) | STATUS_BOLD_BLINK);
+		DRAW_STR(" ");
+	}
+	else {
+		DRAW_STR("   ");	
+	}
 
 	snprintf(strbuff, sizeof(strbuff), "%05d",psnake->score);
-	attron(COLOR_PAIR(COLOR_PAIR_FOOD));
-	addstr("@");
-	attroff(COLOR_PAIR(COLOR_PAIR_FOOD));
-	addstr(strbuff);
-	addstr("   ");	
+	DRAW_ATTRON(COLOR_PAIR(COLOR_PAIR_FOOD));
+	DRAW_STR("@");
+	DRAW_ATTROFF(COLOR_PAIR(COLOR_PAIR_FOOD));
+	DRAW_STR(strbuff);
+	DRAW_STR("   ");	
 	
 
-	if(pset->sound) attron(STATUS_ATTR);
-	addstr("(s)ound");	
-	if(pset->sound) attroff(STATUS_ATTR);
-	addstr("   ");	
+	if(pset->sound) DRAW_ATTRON(STATUS_ATTR);
+	DRAW_STR("(s)ound");	
+	if(pset->sound) DRAW_ATTROFF(STATUS_ATTR);
+	DRAW_STR("   ");	
 
 	if(pset->pause) {
-		attron(STATUS_ATTR);
-		addstr("un(p)ause");	
-		attroff(STATUS_ATTR);
+		DRAW_ATTRON(STATUS_ATTR);
+		DRAW_STR("un(p)ause");	
+		DRAW_ATTROFF(STATUS_ATTR);
 	} 
 	else
 	{
-		addstr("(p)ause");	
+		DRAW_STR("(p)ause");	
 	}
-	addstr("   ");	
+	DRAW_STR("   ");	
 
-	if(pset->portal) attron(STATUS_ATTR);
-	addstr("p(o)rtal");	
-	if(pset->portal) attroff(STATUS_ATTR);
-	addstr("   ");	
+	if(pset->portal) DRAW_ATTRON(STATUS_ATTR);
+	DRAW_STR("p(o)rtal");	
+	if(pset->portal) DRAW_ATTROFF(STATUS_ATTR);
+	DRAW_STR("   ");	
 
-	if(pset->reverse) attron(STATUS_ATTR);
-	addstr("re(v)erse");	
-	if(pset->reverse) attroff(STATUS_ATTR);
-	addstr("   ");	
+	if(pset->reverse) DRAW_ATTRON(STATUS_ATTR);
+	DRAW_STR("re(v)erse");	
+	if(pset->reverse) DRAW_ATTROFF(STATUS_ATTR);
+	DRAW_STR("   ");	
 
-	if(pset->cheat) attron(STATUS_ATTR);
-	addstr("(c)heat");	
-	if(pset->cheat) attroff(STATUS_ATTR);
-	addstr("   ");	
+	if(pset->cheat) DRAW_ATTRON(STATUS_ATTR);
+	DRAW_STR("(c)heat");	
+	if(pset->cheat) DRAW_ATTROFF(STATUS_ATTR);
+	DRAW_STR("   ");	
 
-	addstr("e(x)it");	
-	addstr("   ");	
+	DRAW_STR("e(x)it");	
+	DRAW_STR("   ");	
 
 	if(psnake->term_wall_collision) {
-		attron(COLOR_PAIR(COLOR_PAIR_RED_ON_BLACK) | STATUS_BOLD_BLINK);
-		addstr("**COLLIDED WITH WALL**");
-		attroff(COLOR_PAIR(COLOR_PAIR_RED_ON_BLACK) | STATUS_BOLD_BLINK);
+		DRAW_ATTRON(COLOR_PAIR(COLOR_PAIR_RED_ON_BLACK) | STATUS_BOLD_BLINK);
+		DRAW_STR("**COLLIDED WITH WALL**");
+		DRAW_ATTROFF(COLOR_PAIR(COLOR_PAIR_RED_ON_BLACK) | STATUS_BOLD_BLINK);
+	}
+
+	if(psnake->term_obstacle_collision) {
+		DRAW_ATTRON(COLOR_PAIR(COLOR_PAIR_RED_ON_BLACK) | STATUS_BOLD_BLINK);
+		DRAW_STR("**COLLIDED WITH OBSTACLE**");
+		DRAW_ATTROFF(COLOR_PAIR(COLOR_PAIR_RED_ON_BLACK) | STATUS_BOLD_BLINK);
 	}
 
 	if(psnake->term_self_collision) {
-		attron(COLOR_PAIR(COLOR_PAIR_RED_ON_BLACK) | STATUS_BOLD_BLINK);
-		addstr("**COLLIDED WITH SELF**");
-		attroff(COLOR_PAIR(COLOR_PAIR_RED_ON_BLACK) | STATUS_BOLD_BLINK);
+		DRAW_ATTRON(COLOR_PAIR(COLOR_PAIR_RED_ON_BLACK) | STATUS_BOLD_BLINK);
+		DRAW_STR("**COLLIDED WITH SELF**");
+		DRAW_ATTROFF(COLOR_PAIR(COLOR_PAIR_RED_ON_BLACK) | STATUS_BOLD_BLINK);
 	}
 
 	if(psnake->term_mem_alloc_fail) {
-		attron(COLOR_PAIR(COLOR_PAIR_RED_ON_BLACK) | STATUS_BOLD_BLINK);
-		addstr("**MEMORY ALLOCATION FAILURE**");
-		attroff(COLOR_PAIR(COLOR_PAIR_RED_ON_BLACK) | STATUS_BOLD_BLINK);
+		DRAW_ATTRON(COLOR_PAIR(COLOR_PAIR_RED_ON_BLACK) | STATUS_BOLD_BLINK);
+		DRAW_STR("**MEMORY ALLOCATION FAILURE**");
+		DRAW_ATTROFF(COLOR_PAIR(COLOR_PAIR_RED_ON_BLACK) | STATUS_BOLD_BLINK);
 	}
 
 	if(psnake->term_user_choice) {
-		attron(COLOR_PAIR(COLOR_PAIR_RED_ON_BLACK) | STATUS_BOLD_BLINK);
-		addstr("**BYE**");
-		attroff(COLOR_PAIR(COLOR_PAIR_RED_ON_BLACK) | STATUS_BOLD_BLINK);
+		DRAW_ATTRON(COLOR_PAIR(COLOR_PAIR_RED_ON_BLACK) | STATUS_BOLD_BLINK);
+		DRAW_STR("**BYE**");
+		DRAW_ATTROFF(COLOR_PAIR(COLOR_PAIR_RED_ON_BLACK) | STATUS_BOLD_BLINK);
+	}
+
+	if(psnake->term_board_full) {
+		DRAW_ATTRON(COLOR_PAIR(COLOR_PAIR_RED_ON_BLACK) | STATUS_BOLD_BLINK);
+		DRAW_STR("**BOARD FULL**");
+		DRAW_ATTROFF(COLOR_PAIR(COLOR_PAIR_RED_ON_BLACK) | STATUS_BOLD_BLINK);
 	}
 
-	attroff(COLOR_PAIR(COLOR_PAIR_STATUS));
+	DRAW_ATTROFF(COLOR_PAIR(COLOR_PAIR_STATUS));
 	
 	pset->b_altered = false;
 }
 
-inline NCURSES_SIZE_T y2graph(WINDOW_SNAKE *ws, NCURSES_SIZE_T ysnake)
+static inline NCURSES_SIZE_T y2graph(WINDOW_SNAKE *ws, NCURSES_SIZE_T ysnake)
 {
 	return (ws->_maxy - (ysnake));	
 }
 
+
+bool parse_options(int argc, char *argv[], P_OPTIONS popt)
+{
+	static struct option long_opts[] = {
+		{"level",         required_argument, NULL, 'L'},
+		{"compile-level", required_argument, NULL, 'C'},
+		{"bench",         required_argument, NULL, 'B'},
+		{"bench-size",    required_argument, NULL, 'N'},
+		{"batch",         required_argument, NULL, 'b'},
+		{"batch-steps",   required_argument, NULL, 'S'},
+		{"board",         required_argument, NULL, 'W'},
+		{"speed",         required_argument, NULL, 's'},
+		{"renderer",      required_argument, NULL, 'R'},
+		{"telemetry",     required_argument, NULL, 'T'},
+		{"bot",           required_argument, NULL, 'P'},
+		{"bot-accept",    required_argument, NULL, 'U'},
+		{"render-thread", no_argument,       NULL, 'D'},
+		{"fps",           required_argument, NULL, 'f'},
+		{"shm",           required_argument, NULL, 'M'},
+		{"scores",        required_argument, NULL, 'H'},
+		{"food-ttl",      required_argument, NULL, 'F'},
+		{"boost-ticks",   required_argument, NULL, 'K'},
+		{"portal-ticks",  required_argument, NULL, 'O'},
+		{"stream",        required_argument, NULL, 'Y'},
+		{"view",          required_argument, NULL, 'V'},
+		{"heatmap",       required_argument, NULL, 'E'},
+		{"help",          no_argument,       NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+	int c;
+
+	memset(popt, 0, sizeof(OPTIONS));
+
+	while((c = getopt_long(argc, argv, "L:s:h", long_opts, NULL)) != -1) {
+		switch(c) {
+			case 'L':
+				popt->level_path = optarg;
+				break;
+			case 'C':
+				/* --compile-level SRC DST */
+				if(optind >= argc) {
+					fprintf(stderr, "nsnake: --compile-level needs SRC and DST\n");
+					return false;
+				}
+				popt->compile_src = optarg;
+				popt->compile_dst = argv[optind++];
+				break;
+			case 'B':
+				popt->bench = optarg;
+				break;
+			case 'N':
+				popt->bench_size = atoi(optarg);
+				break;
+			case 'b':
+				popt->batch_games = atoi(optarg);
+				break;
+			case 'S':
+				popt->batch_steps = atoi(optarg);
+				break;
+			case 'W':
+				if(sscanf(optarg, "%dx%d", &popt->board_width,
+					  &popt->board_height) != 2) {
+					fprintf(stderr, "nsnake: --board expects WxH\n");
+					return false;
+				}
+				break;
+			case 'R':
+				popt->renderer = optarg;
+				break;
+			case 'T':
+				popt->telemetry_path = optarg;
+				break;
+			case 'P':
+				popt->bot_path = optarg;
+				break;
+			case 'U':
+				popt->bot_accept = atoi(optarg);
+				break;
+			case 'D':
+				popt->render_thread = true;
+				break;
+			case 'f':
+				popt->fps = atoi(optarg);
+				break;
+			case 'M':
+				popt->shm_name = optarg;
+				break;
+			case 'H':
+				popt->scores_path = optarg;
+				break;
+			case 'F':
+				popt->food_ttl = atoi(optarg);
+				break;
+			case 'K':
+				popt->boost_ticks = atoi(optarg);
+				break;
+			case 'O':
+				popt->portal_ticks = atoi(optarg);
+				break;
+			case 'Y':
+				popt->stream_path = optarg;
+				break;
+			case 'V':
+				popt->view_path = optarg;
+				break;
+			case 'E':
+				popt->heatmap_path = optarg;
+				break;
+			case 's':
+				popt->speed = atoi(optarg);
+				if(popt->speed < MIN_SPEED || popt->speed > MAX_SPEED) {
+					fprintf(stderr, "nsnake: speed must be %d..%d\n",
+						MIN_SPEED, MAX_SPEED);
+					return false;
+				}
+				break;
+			case 'h':
+			default:
+				fprintf(stderr,
+					"usage: nsnake [--level FILE] [--speed N] [--renderer ncurses|ansi]\n"
+					"              [--render-thread [--fps N]] [--shm NAME] [--stream FILE]\n"
+					"              [--telemetry FILE.jsonl|FILE.csv] [--scores FILE]\n"
+					"              [--food-ttl TICKS] [--boost-ticks TICKS] [--portal-ticks TICKS]\n"
+					"              [--heatmap FILE.pgm]\n"
+					"              [--bot BOT.so [--bot-accept USEC]]\n"
+					"       nsnake --view FILE [--renderer ncurses|ansi]\n"
+					"       nsnake --compile-level SRC.txt DST.lvl\n"
+					"       nsnake --bench segments|render|timers [--bench-size N]\n"
+					"       nsnake --batch N [--batch-steps S] [--board WxH] [--level FILE]\n"
+					"                        [--telemetry FILE] [--scores FILE] [--heatmap FILE.pgm]\n"
+					"                        [--bot BOT.so [--bot-accept USEC]]\n");
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/* Lock-free SPSC ring
+ **********************/
+
+bool spsc_init(P_SPSC_RING pring, size_t elem_size, unsigned int capacity)
+{
+	assert(capacity && ! (capacity & (capacity - 1)));
+
+	pring->buf = calloc(capacity, elem_size);
+	if( ! pring->buf) {
+		return false;
+	}
+	pring->elem_size = elem_size;
+	pring->mask = capacity - 1;
+	atomic_init(&pring->head, 0);
+	atomic_init(&pring->tail, 0);
+	return true;
+}
+
+void spsc_free(P_SPSC_RING pring)
+{
+	free(pring->buf);
+	pring->buf = NULL;
+}
+
+/* Producer side; returns false when the ring is full */
+bool spsc_push(P_SPSC_RING pring, const void *elem)
+{
+	unsigned int head = atomic_load_explicit(&pring->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&pring->tail, memory_order_acquire);
+
+	if(head - tail > pring->mask) {
+		return false;
+	}
+
+	memcpy(pring->buf + (size_t)(head & pring->mask) * pring->elem_size,
+	       elem, pring->elem_size);
+	atomic_store_explicit(&pring->head, head + 1, memory_order_release);
+	return true;
+}
+
+/* Consumer side; returns false when the ring is empty */
+bool spsc_pop(P_SPSC_RING pring, void *elem)
+{
+	unsigned int tail = atomic_load_explicit(&pring->tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&pring->head, memory_order_acquire);
+
+	if(head == tail) {
+		return false;
+	}
+
+	memcpy(elem, pring->buf + (size_t)(tail & pring->mask) * pring->elem_size,
+	       pring->elem_size);
+	atomic_store_explicit(&pring->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+long long now_usec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* Keyboard input
+ *****************/
+
+static INPUT input;
+
+static void input_push(int ch, long long t)
+{
+	KEY_EVENT ev = { ch, t };
+
+	if( ! spsc_push(&input.ring, &ev)) {
+		atomic_fetch_add_explicit(&input.dropped, 1, memory_order_relaxed);
+	}
+}
+
+/* Read the terminal directly rather than through wgetch(), which may
+   refresh the screen and must not run concurrently with drawing.
+   Cursor keys arrive as ESC [ A..D or, in keypad mode, ESC O A..D.
+*/
+static void *input_thread(void *arg)
+{
+	static const int arrows[] = { KEY_UP, KEY_DOWN, KEY_RIGHT, KEY_LEFT };
+	struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+	unsigned char buf[64];
+	int esc_state = 0;
+	long long t;
+	ssize_t n, i;
+
+	while( ! atomic_load(&input.quit)) {
+		n = poll(&pfd, 1, INPUT_POLL_MS);
+		if(n == 0) {
+			/* A lone ESC, not the start of a cursor key */
+			esc_state = 0;
+			continue;
+		}
+		if(n < 0) {
+			continue;
+		}
+		if( ! (pfd.revents & POLLIN) && (pfd.revents & (POLLHUP | POLLERR | POLLNVAL))) {
+			break;
+		}
+		n = read(STDIN_FILENO, buf, sizeof(buf));
+		if(n == 0) {
+			/* End of input or the terminal hung up, nothing more to read */
+			break;
+		}
+		if(n < 0) {
+			if(errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			break;
+		}
+		t = now_usec();
+
+		for(i = 0; i < n; i++) {
+			if(esc_state == 1) {
+				esc_state = (buf[i] == '[' || buf[i] == 'O') ? 2 : 0;
+				continue;
+			}
+			if(esc_state == 2) {
+				esc_state = 0;
+				if(buf[i] >= 'A' && buf[i] <= 'D') {
+					input_push(arrows[buf[i] - 'A'], t);
+				}
+				continue;
+			}
+			if(buf[i] == 27) {
+				esc_state = 1;
+				continue;
+			}
+			input_push(buf[i], t);
+		}
+	}
+
+	return NULL;
+}
+
+bool input_init()
+{
+	memset(&input, 0, sizeof(input));
+	atomic_init(&input.quit, false);
+	atomic_init(&input.dropped, 0);
+
+	if( ! spsc_init(&input.ring, sizeof(KEY_EVENT), INPUT_RING_LEN)) {
+		return false;
+	}
+
+	if(pthread_create(&input.thread, NULL, input_thread, NULL)) {
+		spsc_free(&input.ring);
+		return false;
+	}
+
+	input.running = true;
+	return true;
+}
+
+void input_uninit()
+{
+	if( ! input.running) {
+		return;
+	}
+
+	atomic_store(&input.quit, true);
+	pthread_join(input.thread, NULL);
+	spsc_free(&input.ring);
+	input.running = false;
+}
+
+/* Next queued key, or ch == ERR when none is pending.
+   Returns false if there is no input thread to read from.
+*/
+bool input_running()
+{
+	return input.running;
+}
+
+bool input_next(P_KEY_EVENT pev)
+{
+	if( ! input.running) {
+		return false;
+	}
+
+	if( ! spsc_pop(&input.ring, pev)) {
+		pev->ch = ERR;
+		pev->t_arrival = 0;
+	}
+	return true;
+}
+
+/* Called once the snake has moved under a key that arrived at t_arrival */
+void input_record_latency(long long t_arrival)
+{
+	long long lat = now_usec() - t_arrival;
+
+	input.lat_last = lat;
+	input.lat_sum += lat;
+	input.lat_count++;
+	if(lat > input.lat_max) {
+		input.lat_max = lat;
+	}
+}
+
+bool is_steer_key(int ch)
+{
+	switch(ch) {
+		case 'l': case KEY_LEFT:
+		case 'r': case KEY_RIGHT:
+		case 'u': case KEY_UP:
+		case 'd': case KEY_DOWN:
+		case '\\': case 'q':
+		case '/': case 'z':
+			return true;
+	}
+	return false;
+}
+
+/* Debug builds show internals on the top border */
+void show_debug_stats(WINDOW_SNAKE *ws, P_SNAKE psnake)
+{
+	char strbuff[100];
+
+	snprintf(strbuff, sizeof(strbuff),
+		 " seg=%d hash=%016llx in->move last=%.1fms avg=%.1fms max=%.1fms n=%lld drop=%lld ",
+		 psnake->seg_count, (unsigned long long)psnake->zob.hash,
+		 input.lat_last / 1000.0,
+		 input.lat_count ? input.lat_sum / 1000.0 / input.lat_count : 0.0,
+		 input.lat_max / 1000.0,
+		 input.lat_count, atomic_load_explicit(&input.dropped, memory_order_relaxed));
+
+	DRAW_ATTRON(COLOR_PAIR(COLOR_PAIR_STATUS));
+	DRAW_MOVE(ws, ws->_begy - 1, ws->_begx + 1);
+	DRAW_STR(strbuff);
+	DRAW_ATTROFF(COLOR_PAIR(COLOR_PAIR_STATUS));
+}
+
+/* Renderers
+ ************/
+
+P_RENDERER renderer_find(const char *name)
+{
+	P_RENDERER all[] = { &renderer_ncurses, &renderer_ansi };
+	int i;
+
+	if( ! name) {
+		return &renderer_ncurses;
+	}
+	for(i = 0; i < sizeof(all) / sizeof(all[0]); i++) {
+		if( ! strcmp(all[i]->name, name)) {
+			return all[i];
+		}
+	}
+	return NULL;
+}
+
+/* ncurses backend: the original drawing path */
+
+static bool nc_init(P_WINDOW_SNAKE p_ws, FILE *out)
+{
+	return ncurses_init(p_ws, out) != NULL;
+}
+
+static void nc_move(int y, int x)
+{
+	move(y, x);
+}
+
+static void nc_draw_char(int y, int x, chtype ch)
+{
+	mvaddch(y, x, ch);
+}
+
+static void nc_addstr(const char *str)
+{
+	addstr(str);
+}
+
+static void nc_attron(attr_t attr)
+{
+	attron(attr);
+}
+
+static void nc_attroff(attr_t attr)
+{
+	attroff(attr);
+}
+
+static void nc_refresh()
+{
+	refresh();
+}
+
+RENDERER renderer_ncurses = {
+	"ncurses", true, nc_init, ncurses_uninit, nc_move, nc_draw_char,
+	nc_addstr, nc_attron, nc_attroff, nc_refresh
+};
+
+/* Raw ANSI backend: every draw call appends escape sequences to a
+   preallocated frame buffer; refresh() emits the frame with one writev().
+   Cursor position and SGR state are tracked so that only changes are sent.
+*/
+static struct {
+	int fd;
+	bool tty;
+	struct termios saved;
+	int rows, cols;
+	int cur_y, cur_x;		/* Terminal cursor after the last emit */
+	attr_t attr;			/* Attributes requested by attron/off */
+	attr_t attr_sent;		/* Attributes last sent to the terminal */
+	int n_chunks;
+	int used;			/* Bytes used in the last chunk */
+	char chunks[ANSI_MAX_CHUNKS][ANSI_CHUNK_LEN];
+	struct iovec iov[ANSI_MAX_CHUNKS];
+	long long bytes_written;
+} ansi;
+
+/* The chunks are reused once this returns, so a partial write is
+   resumed from where it stopped and a full output waited on, for up to
+   a second at a time like the stream writer does
+*/
+static void ansi_flush()
+{
+	struct pollfd pfd = { ansi.fd, POLLOUT, 0 };
+	struct iovec *iov = ansi.iov;
+	int i, n = ansi.n_chunks;
+	ssize_t r;
+
+	if( ! n || ( n == 1 && ! ansi.used)) {
+		return;
+	}
+	for(i = 0; i < n; i++) {
+		ansi.iov[i].iov_base = ansi.chunks[i];
+		ansi.iov[i].iov_len = (i == n - 1) ? ansi.used : ANSI_CHUNK_LEN;
+	}
+	while(n > 0) {
+		r = writev(ansi.fd, iov, n);
+		if(r <= 0) {
+			if(r < 0 && errno == EINTR) {
+				continue;
+			}
+			if(r == 0 || errno != EAGAIN || poll(&pfd, 1, 1000) <= 0) {
+				break;
+			}
+			continue;
+		}
+		ansi.bytes_written += r;
+		while(n > 0 && (size_t)r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if(n > 0) {
+			iov->iov_base = (char *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+	ansi.n_chunks = 1;
+	ansi.used = 0;
+}
+
+static void ansi_put(const char *buf, int len)
+{
+	int n;
+
+	while(len > 0) {
+		if(ansi.used == ANSI_CHUNK_LEN) {
+			if(ansi.n_chunks == ANSI_MAX_CHUNKS) {
+				ansi_flush();
+			}
+			else {
+				ansi.n_chunks++;
+				ansi.used = 0;
+			}
+		}
+		n = ANSI_CHUNK_LEN - ansi.used;
+		if(n > len) {
+			n = len;
+		}
+		memcpy(&ansi.chunks[ansi.n_chunks - 1][ansi.used], buf, n);
+		ansi.used += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+static void ansi_sgr()
+{
+	char buf[48];
+	int len, pair;
+	attr_t a = ansi.attr;
+
+	if(a == ansi.attr_sent) {
+		return;
+	}
+
+	len = snprintf(buf, sizeof(buf), "\033[0");
+	if(a & WA_BOLD) {
+		len += snprintf(buf + len, sizeof(buf) - len, ";1");
+	}
+	if(a & WA_UNDERLINE) {
+		len += snprintf(buf + len, sizeof(buf) - len, ";4");
+	}
+	if(a & WA_BLINK) {
+		len += snprintf(buf + len, sizeof(buf) - len, ";5");
+	}
+	pair = PAIR_NUMBER(a);
+	if(pair > 0 && pair < COLOR_PAIR_COUNT) {
+		len += snprintf(buf + len, sizeof(buf) - len, ";%d;%d",
+				30 + color_pairs[pair][0], 40 + color_pairs[pair][1]);
+	}
+	len += snprintf(buf + len, sizeof(buf) - len, "m");
+
+	ansi_put(buf, len);
+	ansi.attr_sent = a;
+}
+
+static void ansi_move(int y, int x)
+{
+	char buf[24];
+	int len;
+
+	if(y == ansi.cur_y && x == ansi.cur_x) {
+		return;
+	}
+	len = snprintf(buf, sizeof(buf), "\033[%d;%dH", y + 1, x + 1);
+	ansi_put(buf, len);
+	ansi.cur_y = y;
+	ansi.cur_x = x;
+}
+
+static void ansi_putc(chtype ch)
+{
+	char c = ch & A_CHARTEXT;
+	attr_t saved = ansi.attr;
+
+	ansi.attr |= ch & (A_ATTRIBUTES & ~A_CHARTEXT);
+	ansi_sgr();
+	ansi.attr = saved;
+
+	ansi_put(&c, 1);
+	ansi.cur_x++;
+}
+
+static void ansi_draw_char(int y, int x, chtype ch)
+{
+	ansi_move(y, x);
+	ansi_putc(ch);
+}
+
+static void ansi_addstr(const char *str)
+{
+	int len = strlen(str);
+
+	ansi_sgr();
+	ansi_put(str, len);
+	ansi.cur_x += len;
+}
+
+/* Mirror ncurses: a color pair in attr replaces the current pair */
+static void ansi_attron(attr_t attr)
+{
+	if(attr & A_COLOR) {
+		ansi.attr &= ~A_COLOR;
+	}
+	ansi.attr |= attr;
+}
+
+static void ansi_attroff(attr_t attr)
+{
+	if(attr & A_COLOR) {
+		ansi.attr &= ~A_COLOR;
+	}
+	ansi.attr &= ~(attr & ~A_COLOR);
+}
+
+static void ansi_refresh()
+{
+	ansi_flush();
+}
+
+static bool ansi_init(P_WINDOW_SNAKE p_ws, FILE *out)
+{
+	struct winsize wsz;
+	struct termios raw;
+	int y, x;
+
+	memset(&ansi, 0, sizeof(ansi));
+	ansi.fd = out ? fileno(out) : STDOUT_FILENO;
+	ansi.n_chunks = 1;
+	ansi.cur_y = ansi.cur_x = -1;
+	ansi.attr_sent = (attr_t)-1;
+
+	ansi.rows = 24;
+	ansi.cols = 80;
+	if(ioctl(ansi.fd, TIOCGWINSZ, &wsz) == 0 && wsz.ws_row && wsz.ws_col) {
+		ansi.rows = wsz.ws_row;
+		ansi.cols = wsz.ws_col;
+	}
+	else if(getenv("LINES") && getenv("COLUMNS")) {
+		ansi.rows = atoi(getenv("LINES"));
+		ansi.cols = atoi(getenv("COLUMNS"));
+	}
+
+	/* Same terminal modes as ncurses_init(): cbreak, noecho, nonl */
+	ansi.tty = ! out && isatty(STDIN_FILENO);
+	if(ansi.tty) {
+		tcgetattr(STDIN_FILENO, &ansi.saved);
+		raw = ansi.saved;
+		raw.c_lflag &= ~(ICANON | ECHO);
+		raw.c_iflag &= ~ICRNL;
+		raw.c_cc[VMIN] = 1;
+		raw.c_cc[VTIME] = 0;
+		tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+	}
+
+	/* Alternate screen, hide cursor, clear */
+	ansi_put("\033[?1049h\033[?25l\033[H\033[2J", 23);
+
+	/* Box around the board, leaving the status bar inside it */
+	ansi_attron(COLOR_PAIR(COLOR_PAIR_BOX));
+	for(x = 0; x < ansi.cols; x++) {
+		ansi_draw_char(0, x, (x == 0 || x == ansi.cols - 1) ? '+' : '-');
+		ansi_draw_char(ansi.rows - 1, x, (x == 0 || x == ansi.cols - 1) ? '+' : '-');
+	}
+	for(y = 1; y < ansi.rows - 1; y++) {
+		ansi_draw_char(y, 0, '|');
+		ansi_draw_char(y, ansi.cols - 1, '|');
+	}
+	ansi_attroff(COLOR_PAIR(COLOR_PAIR_BOX));
+
+	p_ws->_begy = 1;
+	p_ws->_begx = 1;
+	p_ws->_maxy = ansi.rows - 3;
+	p_ws->_maxx = ansi.cols - 2;
+	return true;
+}
+
+static void ansi_uninit()
+{
+	ansi.attr = 0;
+	ansi_sgr();
+	ansi_put("\033[?25h\033[?1049l", 14);
+	ansi_flush();
+	if(ansi.tty) {
+		tcsetattr(STDIN_FILENO, TCSANOW, &ansi.saved);
+	}
+}
+
+RENDERER renderer_ansi = {
+	"ansi", false, ansi_init, ansi_uninit, ansi_move, ansi_draw_char,
+	ansi_addstr, ansi_attron, ansi_attroff, ansi_refresh
+};
+
+/* Snapshot backend for --render-thread. The game draws into a canvas
+   grid and flush_frame() publishes a copy through a triple buffer. A
+   render thread wakes at the frame rate cap, takes the newest frame and
+   hands the cells that differ from the screen to the real backend.
+   Frames published in between are overwritten, so a slow terminal drops
+   frames instead of slowing the game down.
+*/
+static struct {
+	P_RENDERER out;			/* Real backend, used by the thread only */
+	int fps;
+	int rows, cols;
+	chtype *canvas;			/* What the game has drawn so far */
+	chtype *slot[3];
+	chtype *shown;			/* What the real backend shows */
+	int back;			/* Slot owned by the game */
+	int front;			/* Slot owned by the render thread */
+	atomic_uint ready;		/* Slot in between, maybe FRAME_FRESH */
+	int cur_y, cur_x;
+	attr_t attr;
+	pthread_t thread;
+	atomic_bool quit;
+	long long published;
+	long long drawn;
+} frame;
+
+void frame_setup(P_RENDERER out, int fps)
+{
+	frame.out = out;
+	frame.fps = fps > 0 ? fps : DEFAULT_FPS;
+}
+
+/* Take the newest frame, if there is one, and draw what changed */
+static void frame_present()
+{
+	chtype *f;
+	int i, n = frame.rows * frame.cols;
+	bool changed = false;
+
+	if( ! (atomic_load(&frame.ready) & FRAME_FRESH)) {
+		return;
+	}
+	frame.front = atomic_exchange(&frame.ready, frame.front) & ~FRAME_FRESH;
+
+	f = frame.slot[frame.front];
+	for(i = 0; i < n; i++) {
+		if(f[i] != frame.shown[i]) {
+			frame.out->draw_char(i / frame.cols, i % frame.cols, f[i]);
+			frame.shown[i] = f[i];
+			changed = true;
+		}
+	}
+	if(changed) {
+		frame.out->flush_frame();
+	}
+	frame.drawn++;
+}
+
+static void *frame_thread(void *arg)
+{
+	struct timespec period = { 0, 1000000000L / frame.fps };
+
+	while( ! atomic_load(&frame.quit)) {
+		frame_present();
+		nanosleep(&period, NULL);
+	}
+
+	/* Whatever the game drew last */
+	frame_present();
+	return NULL;
+}
+
+static void frame_free()
+{
+	int i;
+
+	free(frame.canvas);
+	free(frame.shown);
+	for(i = 0; i < 3; i++) {
+		free(frame.slot[i]);
+	}
+}
+
+static bool frame_init(P_WINDOW_SNAKE p_ws, FILE *out)
+{
+	int i, n;
+
+	if( ! frame.out->init(p_ws, out)) {
+		return false;
+	}
+
+	/* Board, status bar and the box around them */
+	frame.rows = p_ws->_maxy + 3;
+	frame.cols = p_ws->_maxx + 2;
+	n = frame.rows * frame.cols;
+
+	frame.canvas = malloc(n * sizeof(chtype));
+	frame.shown = malloc(n * sizeof(chtype));
+	for(i = 0; i < 3; i++) {
+		frame.slot[i] = malloc(n * sizeof(chtype));
+	}
+	if( ! frame.canvas || ! frame.shown ||
+	    ! frame.slot[0] || ! frame.slot[1] || ! frame.slot[2]) {
+		frame_free();
+		frame.out->uninit();
+		return false;
+	}
+
+	/* Cells nobody draws (the box) stay as the real backend left them */
+	for(i = 0; i < n; i++) {
+		frame.canvas[i] = frame.shown[i] = ' ';
+	}
+	frame.back = 0;
+	atomic_init(&frame.ready, 1);
+	frame.front = 2;
+	frame.cur_y = frame.cur_x = 0;
+	frame.attr = 0;
+	frame.published = frame.drawn = 0;
+
+	atomic_init(&frame.quit, false);
+	if(pthread_create(&frame.thread, NULL, frame_thread, NULL)) {
+		frame_free();
+		frame.out->uninit();
+		return false;
+	}
+	return true;
+}
+
+static void frame_uninit()
+{
+	atomic_store(&frame.quit, true);
+	pthread_join(frame.thread, NULL);
+	frame.out->uninit();
+	frame_free();
+
+	fprintf(stderr, "render: %lld frames published, %lld drawn, %lld dropped\n",
+		frame.published, frame.drawn, frame.published - frame.drawn);
+}
+
+static void frame_move(int y, int x)
+{
+	frame.cur_y = y;
+	frame.cur_x = x;
+}
+
+static void frame_putc(chtype ch)
+{
+	if(frame.cur_y >= 0 && frame.cur_y < frame.rows &&
+	   frame.cur_x >= 0 && frame.cur_x < frame.cols) {
+		frame.canvas[frame.cur_y * frame.cols + frame.cur_x] = ch | frame.attr;
+	}
+	frame.cur_x++;
+}
+
+static void frame_draw_char(int y, int x, chtype ch)
+{
+	frame_move(y, x);
+	frame_putc(ch);
+}
+
+static void frame_addstr(const char *str)
+{
+	while(*str) {
+		frame_putc((unsigned char)*str++);
+	}
+}
+
+/* Same attribute rules as the ANSI backend */
+static void frame_attron(attr_t attr)
+{
+	if(attr & A_COLOR) {
+		frame.attr &= ~A_COLOR;
+	}
+	frame.attr |= attr;
+}
+
+static void frame_attroff(attr_t attr)
+{
+	if(attr & A_COLOR) {
+		frame.attr &= ~A_COLOR;
+	}
+	frame.attr &= ~(attr & ~A_COLOR);
+}
+
+/* Publish the canvas; never waits for the render thread */
+static void frame_refresh()
+{
+	memcpy(frame.slot[frame.back], frame.canvas,
+	       frame.rows * frame.cols * sizeof(chtype));
+	frame.back = atomic_exchange(&frame.ready, frame.back | FRAME_FRESH) & ~FRAME_FRESH;
+	frame.published++;
+}
+
+RENDERER renderer_frame = {
+	"frame", false, frame_init, frame_uninit, frame_move, frame_draw_char,
+	frame_addstr, frame_attron, frame_attroff, frame_refresh
+};
+
+/* Spectator stream backend for --stream. Passes everything through to
+   the real backend while keeping a canvas of what it has drawn. Each
+   refresh sends the cells that differ from what the viewer was last
+   sent, run-length coded. The file descriptor is non-blocking. If the
+   previous frame is still only partly written, the new frame is
+   dropped. The next frame is then coded against what the viewer
+   really has, so drops never corrupt the picture.
+*/
+static struct {
+	P_RENDERER out;
+	int fd;
+	int rows, cols;
+	chtype *canvas;			/* What the game has drawn */
+	chtype *sent;			/* What the viewer has been sent */
+	bool full;			/* Next frame covers every cell */
+	int cur_y, cur_x;
+	attr_t attr;
+	char *buf;			/* Encoded frame ... */
+	size_t len, off;		/* ... and how much of it went out */
+	long long t0;
+	long long frames;
+	long long dropped;
+	long long bytes;
+} stream;
+
+/* Open the stream before the screen so errors can still be printed.
+   A FIFO is opened for reading too: the game neither waits for a viewer
+   to turn up nor gets SIGPIPE when one leaves.
+*/
+bool stream_setup(P_RENDERER out, const char *path)
+{
+	struct stat st;
+
+	memset(&stream, 0, sizeof(stream));
+	stream.out = out;
+	renderer_stream.has_curses = out->has_curses;
+	if(stat(path, &st) == 0 && S_ISFIFO(st.st_mode)) {
+		stream.fd = open(path, O_RDWR | O_NONBLOCK);
+	}
+	else {
+		stream.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK, 0644);
+	}
+	return stream.fd >= 0;
+}
+
+/* Write out as much of the pending frame as the consumer takes.
+   Returns true once nothing is pending.
+*/
+static bool stream_send()
+{
+	ssize_t n;
+
+	while(stream.off < stream.len) {
+		n = write(stream.fd, stream.buf + stream.off, stream.len - stream.off);
+		if(n <= 0) {
+			break;
+		}
+		stream.off += n;
+		stream.bytes += n;
+	}
+	if(stream.off == stream.len) {
+		stream.off = stream.len = 0;
+	}
+	return stream.len == 0;
+}
+
+/* Give a slow viewer up to a second to take what is pending */
+static bool stream_drain()
+{
+	struct pollfd pfd = { stream.fd, POLLOUT, 0 };
+
+	while( ! stream_send()) {
+		if(poll(&pfd, 1, 1000) <= 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void stream_free()
+{
+	free(stream.canvas);
+	free(stream.sent);
+	free(stream.buf);
+}
+
+static bool stream_init(P_WINDOW_SNAKE p_ws, FILE *out)
+{
+	STREAM_HEADER hdr;
+	int n;
+
+	if( ! stream.out->init(p_ws, out)) {
+		close(stream.fd);
+		return false;
+	}
+
+	/* Same area as the frame backend: board, status bar and the box */
+	stream.rows = p_ws->_maxy + 3;
+	stream.cols = p_ws->_maxx + 2;
+	n = stream.rows * stream.cols;
+
+	/* One run per cell at worst, plus the runs that only skip */
+	stream.canvas = calloc(n, sizeof(chtype));
+	stream.sent = calloc(n, sizeof(chtype));
+	stream.buf = malloc(sizeof(STREAM_FRAME) +
+			    (n + n / STREAM_RUN_MAX + 1) * sizeof(STREAM_RUN));
+	if( ! stream.canvas || ! stream.sent || ! stream.buf) {
+		stream_free();
+		stream.out->uninit();
+		close(stream.fd);
+		return false;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, STREAM_MAGIC, 4);
+	hdr.version = STREAM_VERSION;
+	hdr.rows = stream.rows;
+	hdr.cols = stream.cols;
+	memcpy(stream.buf, &hdr, sizeof(hdr));
+	stream.len = sizeof(hdr);
+	stream_send();
+
+	stream.full = true;
+	stream.t0 = now_usec();
+	return true;
+}
+
+static void stream_encode();
+
+/* The last frame may have been dropped, send it once the rest is out */
+static void stream_uninit()
+{
+	if(stream_drain()) {
+		stream_encode();
+		stream_drain();
+	}
+	stream.out->uninit();
+	close(stream.fd);
+	stream_free();
+
+	fprintf(stderr, "stream: %lld frames written, %lld dropped, %lld bytes\n",
+		stream.frames, stream.dropped, stream.bytes);
+}
+
+static void stream_move(int y, int x)
+{
+	stream.cur_y = y;
+	stream.cur_x = x;
+	stream.out->cursor(y, x);
+}
+
+static void stream_putc(chtype ch)
+{
+	if(stream.cur_y >= 0 && stream.cur_y < stream.rows &&
+	   stream.cur_x >= 0 && stream.cur_x < stream.cols) {
+		stream.canvas[stream.cur_y * stream.cols + stream.cur_x] = ch | stream.attr;
+	}
+	stream.cur_x++;
+}
+
+static void stream_draw_char(int y, int x, chtype ch)
+{
+	stream.cur_y = y;
+	stream.cur_x = x;
+	stream_putc(ch);
+	stream.out->draw_char(y, x, ch);
+}
+
+static void stream_addstr(const char *str)
+{
+	const char *p;
+
+	for(p = str; *p; p++) {
+		stream_putc((unsigned char)*p);
+	}
+	stream.out->draw_str(str);
+}
+
+/* Same attribute rules as the ANSI backend */
+static void stream_attron(attr_t attr)
+{
+	if(attr & A_COLOR) {
+		stream.attr &= ~A_COLOR;
+	}
+	stream.attr |= attr;
+	stream.out->attrib_on(attr);
+}
+
+static void stream_attroff(attr_t attr)
+{
+	if(attr & A_COLOR) {
+		stream.attr &= ~A_COLOR;
+	}
+	stream.attr &= ~(attr & ~A_COLOR);
+	stream.out->attrib_off(attr);
+}
+
+/* Code the changed cells as runs of one value and start sending them */
+static void stream_encode()
+{
+	P_STREAM_FRAME pf = (P_STREAM_FRAME)stream.buf;
+	P_STREAM_RUN run = (P_STREAM_RUN)(pf + 1);
+	int i, start, end = 0, skip, n = stream.rows * stream.cols;
+	unsigned int n_runs = 0;
+	chtype v;
+
+	for(i = 0; i < n; ) {
+		if( ! stream.full && stream.canvas[i] == stream.sent[i]) {
+			i++;
+			continue;
+		}
+		start = i;
+		v = stream.canvas[i];
+		do {
+			stream.sent[i++] = v;
+		} while(i < n && i - start < STREAM_RUN_MAX && stream.canvas[i] == v &&
+			(stream.full || stream.sent[i] != v));
+
+		for(skip = start - end; skip > STREAM_RUN_MAX; skip -= STREAM_RUN_MAX) {
+			run[n_runs].skip = STREAM_RUN_MAX;
+			run[n_runs].count = 0;
+			run[n_runs].cell = 0;
+			n_runs++;
+		}
+		run[n_runs].skip = skip;
+		run[n_runs].count = i - start;
+		run[n_runs].cell = v;
+		n_runs++;
+		end = i;
+	}
+	stream.full = false;
+
+	if( ! n_runs) {
+		return;
+	}
+	pf->time_ms = (now_usec() - stream.t0) / 1000;
+	pf->n_runs = n_runs;
+	stream.len = sizeof(STREAM_FRAME) + n_runs * sizeof(STREAM_RUN);
+	stream.off = 0;
+	stream.frames++;
+	stream_send();
+}
+
+static void stream_refresh()
+{
+	stream.out->flush_frame();
+
+	if( ! stream_send()) {
+		stream.dropped++;
+		return;
+	}
+	stream_encode();
+}
+
+RENDERER renderer_stream = {
+	"stream", false, stream_init, stream_uninit, stream_move, stream_draw_char,
+	stream_addstr, stream_attron, stream_attroff, stream_refresh
+};
+
+/* Stream viewer
+ ****************/
+
+/* Wait up to ms (forever if negative) for a key; true if it was 'x' */
+static bool view_quit_key(int ms)
+{
+	struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+	char c;
+
+	if(poll(&pfd, 1, ms) > 0 && read(STDIN_FILENO, &c, 1) == 1) {
+		return tolower((unsigned char)c) == 'x';
+	}
+	return false;
+}
+
+/* Read exactly len bytes, waiting on a live stream as long as it takes.
+   False at the end of the stream or when the viewer quits.
+*/
+static bool view_read(int fd, void *buf, size_t len, bool *pquit)
+{
+	struct pollfd pfd[2] = { { fd, POLLIN, 0 }, { STDIN_FILENO, POLLIN, 0 } };
+	size_t got = 0;
+	ssize_t n;
+
+	while(got < len) {
+		if(poll(pfd, 2, -1) < 0) {
+			return false;
+		}
+		if((pfd[1].revents & POLLIN) && view_quit_key(0)) {
+			*pquit = true;
+			return false;
+		}
+		if( ! (pfd[0].revents & (POLLIN | POLLHUP))) {
+			continue;
+		}
+		n = read(fd, (char *)buf + got, len - got);
+		if(n <= 0) {
+			return false;
+		}
+		got += n;
+	}
+	return true;
+}
+
+/* Show a --stream recording. A FIFO is followed live; a file is played
+   back at the pace it was recorded. 'x' quits.
+*/
+int run_view(P_OPTIONS popt)
+{
+	WINDOW_SNAKE ws;
+	STREAM_HEADER hdr;
+	STREAM_FRAME fr;
+	P_STREAM_RUN runs = NULL;
+	chtype *shown = NULL;
+	struct stat st;
+	long long t_start, frames = 0;
+	unsigned int r, k, max_runs, cap = 0;
+	int fd, n, pos, rows, cols, wait_ms;
+	bool live, quit = false;
+
+	fd = open(popt->view_path, O_RDONLY);
+	if(fd < 0 || fstat(fd, &st) < 0) {
+		perror(popt->view_path);
+		return 1;
+	}
+	live = S_ISFIFO(st.st_mode);
+
+	if( ! view_read(fd, &hdr, sizeof(hdr), &quit) ||
+	    memcmp(hdr.magic, STREAM_MAGIC, 4) || hdr.version != STREAM_VERSION) {
+		fprintf(stderr, "nsnake: %s is not a stream\n", popt->view_path);
+		close(fd);
+		return 1;
+	}
+	n = hdr.rows * hdr.cols;
+	max_runs = n + n / STREAM_RUN_MAX + 1;
+	shown = calloc(n, sizeof(chtype));
+
+	renderer = renderer_find(popt->renderer);
+	if( ! renderer || ! shown || ! renderer->init(&ws, NULL)) {
+		fprintf(stderr, "nsnake: could not initialize the screen\n");
+		free(shown);
+		close(fd);
+		return 1;
+	}
+
+	/* Cells beyond a smaller terminal than the recording are left out */
+	rows = ws._maxy + 3 < hdr.rows ? ws._maxy + 3 : hdr.rows;
+	cols = ws._maxx + 2 < hdr.cols ? ws._maxx + 2 : hdr.cols;
+
+	t_start = now_usec();
+	while(view_read(fd, &fr, sizeof(fr), &quit)) {
+		if(fr.n_runs > max_runs) {
+			break;
+		}
+		if(fr.n_runs > cap) {
+			free(runs);
+			cap = fr.n_runs;
+			runs = malloc(cap * sizeof(STREAM_RUN));
+			if( ! runs) {
+				break;
+			}
+		}
+		if( ! view_read(fd, runs, fr.n_runs * sizeof(STREAM_RUN), &quit)) {
+			break;
+		}
+
+		if( ! live) {
+			wait_ms = (t_start + fr.time_ms * 1000LL - now_usec()) / 1000;
+			if(wait_ms > 0 && view_quit_key(wait_ms)) {
+				quit = true;
+				break;
+			}
+		}
+
+		for(pos = 0, r = 0; r < fr.n_runs; r++) {
+			pos += runs[r].skip;
+			for(k = 0; k < runs[r].count && pos < n; k++, pos++) {
+				if( ! runs[r].cell || shown[pos] == runs[r].cell) {
+					continue;
+				}
+				shown[pos] = runs[r].cell;
+				if(pos / hdr.cols < rows && pos % hdr.cols < cols) {
+					DRAW_CHAR(&ws, pos / hdr.cols, pos % hdr.cols, runs[r].cell);
+				}
+			}
+		}
+		DRAW_REFRESH();
+		frames++;
+	}
+
+	/* Hold the last frame like the game does */
+	if( ! quit) {
+		view_quit_key(5000);
+	}
+
+	renderer->uninit();
+	printf("view: %lld frames\n", frames);
+	free(runs);
+	free(shown);
+	close(fd);
+	return 0;
+}
+
+/* Shared memory export
+ ***********************/
+
+static SHM_EXPORT shm_export;
+
+bool shm_export_open(const char *name, WINDOW_SNAKE *ws)
+{
+	int fd;
+
+	shm_export.cells = ws->plevel->width * ws->plevel->height;
+	shm_export.size = sizeof(NSNAKE_SHM) + shm_export.cells;
+
+	fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+	if(fd < 0) {
+		return false;
+	}
+	if(ftruncate(fd, shm_export.size) < 0) {
+		close(fd);
+		shm_unlink(name);
+		return false;
+	}
+	shm_export.map = mmap(NULL, shm_export.size, PROT_READ | PROT_WRITE,
+			      MAP_SHARED, fd, 0);
+	close(fd);
+	if(shm_export.map == MAP_FAILED) {
+		shm_export.map = NULL;
+		shm_unlink(name);
+		return false;
+	}
+	shm_export.name = strdup(name);
+
+	/* Readers check magic and version after the first update */
+	memset(shm_export.map, 0, shm_export.size);
+	memcpy(shm_export.map->magic, NSNAKE_SHM_MAGIC, 4);
+	shm_export.map->version = NSNAKE_SHM_VERSION;
+	shm_export.map->size = shm_export.size;
+	shm_export.map->width = ws->plevel->width;
+	shm_export.map->height = ws->plevel->height;
+	shm_export.map->begx = ws->_begx;
+	shm_export.map->begy = ws->_begy;
+	atomic_init(&shm_export.map->seq, 0);
+	return true;
+}
+
+/* Write side of the seqlock: seq goes odd, the state is rewritten and
+   seq goes even again. Readers never hold anything up.
+*/
+void shm_export_publish(P_SETTINGS pset, P_SNAKE psnake, P_FOOD pfood)
+{
+	P_NSNAKE_SHM m = shm_export.map;
+	unsigned int seq;
+
+	if( ! m) {
+		return;
+	}
+
+	seq = atomic_load_explicit(&m->seq, memory_order_relaxed);
+	atomic_store_explicit(&m->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	m->running = ! snake_term_cause(psnake);
+	m->ticks = psnake->ticks;
+	m->score = psnake->score;
+	m->length = psnake->length;
+	m->head_x = psnake->seg_head->coord_start.x;
+	m->head_y = psnake->seg_head->coord_start.y;
+	m->dir = psnake->seg_head->dir;
+	m->food_present = ! pfood->b_eaten;
+	m->food_x = pfood->coord.x;
+	m->food_y = pfood->coord.y;
+	m->speed = pset->speed;
+	m->pause = pset->pause;
+	m->portal = pset->portal;
+	m->reverse = pset->reverse;
+	m->cheat = pset->cheat;
+	m->hash = psnake->zob.hash;
+	memcpy(m->occupied, psnake->occupied, shm_export.cells);
+
+	atomic_store_explicit(&m->seq, seq + 2, memory_order_release);
+}
+
+/* Mark the game over and remove the name; mapped readers keep the
+   final state
+*/
+void shm_export_close()
+{
+	unsigned int seq;
+
+	if( ! shm_export.map) {
+		return;
+	}
+
+	seq = atomic_load_explicit(&shm_export.map->seq, memory_order_relaxed);
+	atomic_store_explicit(&shm_export.map->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	shm_export.map->running = 0;
+	atomic_store_explicit(&shm_export.map->seq, seq + 2, memory_order_release);
+
+	munmap(shm_export.map, shm_export.size);
+	shm_unlink(shm_export.name);
+	free(shm_export.name);
+	shm_export.map = NULL;
+}
+
+/* Timer wheel
+ **************/
+
+void timer_wheel_init(P_TIMER_WHEEL tw)
+{
+	int level, slot;
+
+	tw->now = 0;
+	for(level = 0; level < TIMER_LEVELS; level++) {
+		for(slot = 0; slot < TIMER_SLOTS; slot++) {
+			tw->slots[level][slot].next = &tw->slots[level][slot];
+			tw->slots[level][slot].prev = &tw->slots[level][slot];
+		}
+	}
+}
+
+void timer_init(P_TIMER pt, timer_fn_t fn, void *arg)
+{
+	pt->next = NULL;
+	pt->prev = NULL;
+	pt->expires = 0;
+	pt->fn = fn;
+	pt->arg = arg;
+}
+
+static void timer_unlink(P_TIMER pt)
+{
+	pt->prev->next = pt->next;
+	pt->next->prev = pt->prev;
+	pt->next = NULL;
+	pt->prev = NULL;
+}
+
+/* Level 0 holds the next TIMER_SLOTS ticks one per slot, level n the
+   ticks up to TIMER_SLOTS^(n+1) ahead in slots of TIMER_SLOTS^n. A timer
+   further out than the wheel spans waits in the last slot it can reach.
+*/
+static void timer_link(P_TIMER_WHEEL tw, P_TIMER pt)
+{
+	unsigned long long at = pt->expires;
+	P_TIMER head;
+	int level = 0;
+
+	if(at - tw->now >= TIMER_SPAN) {
+		at = tw->now + TIMER_SPAN - 1;
+	}
+	while((at - tw->now) >> (TIMER_SLOT_BITS * (level + 1))) {
+		level++;
+	}
+
+	head = &tw->slots[level][(at >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1)];
+	pt->next = head;
+	pt->prev = head->prev;
+	head->prev->next = pt;
+	head->prev = pt;
+}
+
+/* Move a whole slot list onto the local list head in O(1) */
+static void timer_splice(P_TIMER head, P_TIMER into)
+{
+	if(head->next == head) {
+		into->next = into;
+		into->prev = into;
+		return;
+	}
+	into->next = head->next;
+	into->prev = head->prev;
+	into->next->prev = into;
+	into->prev->next = into;
+	head->next = head;
+	head->prev = head;
+}
+
+/* Fire after ticks game ticks; a pending timer is moved */
+void timer_add(P_TIMER_WHEEL tw, P_TIMER pt, unsigned long long ticks)
+{
+	timer_add_at(tw, pt, tw->now + (ticks ? ticks : 1));
+}
+
+/* Fire on tick expires, which must not have passed */
+void timer_add_at(P_TIMER_WHEEL tw, P_TIMER pt, unsigned long long expires)
+{
+	if(pt->next) {
+		timer_unlink(pt);
+	}
+	pt->expires = expires;
+	timer_link(tw, pt);
+}
+
+void timer_cancel(P_TIMER pt)
+{
+	if(pt->next) {
+		timer_unlink(pt);
+	}
+}
+
+bool timer_pending(P_TIMER pt)
+{
+	return pt->next != NULL;
+}
+
+/* Advance one tick and fire what is due, returning how many fired.
+   Each time a level's slot index wraps, the next slot of the level above
+   is redistributed below, so every timer is moved at most once per level.
+*/
+int timer_wheel_tick(P_TIMER_WHEEL tw)
+{
+	TIMER due;
+	P_TIMER pt;
+	unsigned long long now = ++tw->now;
+	int level, fired = 0;
+
+	for(level = 1; level < TIMER_LEVELS; level++) {
+		if(now & ((1ULL << (TIMER_SLOT_BITS * level)) - 1)) {
+			break;
+		}
+		timer_splice(&tw->slots[level][(now >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1)],
+			     &due);
+		while(due.next != &due) {
+			pt = due.next;
+			timer_unlink(pt);
+			timer_link(tw, pt);
+		}
+	}
+
+	/* Callbacks may add or cancel timers, this slot's included */
+	timer_splice(&tw->slots[0][now & (TIMER_SLOTS - 1)], &due);
+	while(due.next != &due) {
+		pt = due.next;
+		timer_unlink(pt);
+		if(pt->expires > now) {
+			/* Was beyond the span when added */
+			timer_link(tw, pt);
+			continue;
+		}
+		pt->fn(pt);
+		fired++;
+	}
+
+	return fired;
+}
+
+static P_TIMER game_timer_by_id(P_GAME_TIMERS pgt, game_timer_t id)
+{
+	switch(id) {
+		case GAME_TIMER_FOOD:
+			return &pgt->food;
+		case GAME_TIMER_BOOST:
+			return &pgt->boost;
+		default:
+			return &pgt->portal;
+	}
+}
+
+/* Record a timer's state before it changes, for rewind */
+static void game_timer_record(P_GAME_TIMERS pgt, P_TIMER pt, bool pending)
+{
+	game_timer_t id = pt == &pgt->food ? GAME_TIMER_FOOD :
+			  pt == &pgt->boost ? GAME_TIMER_BOOST : GAME_TIMER_PORTAL;
+
+	if(pending) {
+		history_value(HIST_TIMER, id | HIST_TIMER_PENDING,
+			      pt->expires - pgt->wheel.now);
+	}
+	else {
+		history_value(HIST_TIMER, id, 0);
+	}
+}
+
+static void game_timer_arm(P_GAME_TIMERS pgt, P_TIMER pt, int ticks)
+{
+	game_timer_record(pgt, pt, timer_pending(pt));
+	timer_add(&pgt->wheel, pt, ticks);
+}
+
+static void game_timer_disarm(P_GAME_TIMERS pgt, P_TIMER pt)
+{
+	if(timer_pending(pt)) {
+		game_timer_record(pgt, pt, true);
+		timer_cancel(pt);
+	}
+}
+
+/* Food left uneaten for too long moves elsewhere */
+static void game_timer_food(P_TIMER pt)
+{
+	P_GAME_TIMERS pgt = pt->arg;
+	P_COORD pc = &pgt->pfood->coord;
+
+	/* Firing unlinked it; it was due this tick */
+	game_timer_record(pgt, pt, true);
+
+	/* Eaten on the tick it was due */
+	if(pgt->pfood->b_eaten) {
+		return;
+	}
+
+	snake_erase_cell(pgt->ws, pgt->pset, pgt->psnake, pc);
+	place_food(pgt->ws, pgt->pset, pgt->pfood, pgt->psnake);
+	game_timer_arm(pgt, pt, pgt->pset->food_ttl);
+}
+
+static void game_timer_boost(P_TIMER pt)
+{
+	P_GAME_TIMERS pgt = pt->arg;
+
+	game_timer_record(pgt, pt, true);
+	history_value(HIST_SPEED, 0, pgt->pset->speed);
+	history_value(HIST_BOOST, 0, pgt->boost_delta);
+
+	/* Keep any +/- made during the boost */
+	pgt->pset->speed = game_timers_base_speed(pgt);
+	pgt->boost_delta = 0;
+	pgt->pset->b_altered = true;
+}
+
+static void game_timer_portal(P_TIMER pt)
+{
+	P_GAME_TIMERS pgt = pt->arg;
+
+	game_timer_record(pgt, pt, true);
+	history_value(HIST_SETTING, HIST_SET_PORTAL, pgt->pset->portal);
+	pgt->pset->portal = false;
+	zobrist_settings(&pgt->psnake->zob, pgt->pset);
+	pgt->pset->b_altered = true;
+}
+
+void game_timers_init(P_GAME_TIMERS pgt, WINDOW_SNAKE *ws, P_SETTINGS pset,
+		      P_SNAKE psnake, P_FOOD pfood)
+{
+	timer_wheel_init(&pgt->wheel);
+	timer_init(&pgt->food, game_timer_food, pgt);
+	timer_init(&pgt->boost, game_timer_boost, pgt);
+	timer_init(&pgt->portal, game_timer_portal, pgt);
+	pgt->boost_delta = 0;
+	pgt->ws = ws;
+	pgt->pset = pset;
+	pgt->psnake = psnake;
+	pgt->pfood = pfood;
+}
+
+/* The speed without a running boost, what the game is played and
+   recorded at
+*/
+int game_timers_base_speed(P_GAME_TIMERS pgt)
+{
+	int speed = pgt->pset->speed - pgt->boost_delta;
+
+	return speed < MIN_SPEED ? MIN_SPEED : speed;
+}
+
+/* Called once per game tick, after the move. Timers follow the state
+   they belong to: eaten food takes its timer with it, and portals
+   turned on (at start or with 'o') get a fresh one.
+*/
+void game_timers_tick(P_GAME_TIMERS pgt, bool ate)
+{
+	P_SETTINGS pset = pgt->pset;
+
+	history_value(HIST_WHEEL, 0, 0);
+	timer_wheel_tick(&pgt->wheel);
+
+	if(pset->food_ttl) {
+		if(pgt->pfood->b_eaten) {
+			game_timer_disarm(pgt, &pgt->food);
+		}
+		else if( ! timer_pending(&pgt->food)) {
+			game_timer_arm(pgt, &pgt->food, pset->food_ttl);
+		}
+	}
+
+	if(ate && pset->boost_ticks) {
+		if( ! timer_pending(&pgt->boost)) {
+			history_value(HIST_SPEED, 0, pset->speed);
+			history_value(HIST_BOOST, 0, pgt->boost_delta);
+			pgt->boost_delta = pset->speed + BOOST_SPEED < MAX_SPEED ?
+					   BOOST_SPEED : MAX_SPEED - pset->speed;
+			pset->speed += pgt->boost_delta;
+		}
+		game_timer_arm(pgt, &pgt->boost, pset->boost_ticks);
+	}
+
+	if(pset->portal_ticks) {
+		if( ! pset->portal) {
+			game_timer_disarm(pgt, &pgt->portal);
+		}
+		else if( ! timer_pending(&pgt->portal)) {
+			game_timer_arm(pgt, &pgt->portal, pset->portal_ticks);
+		}
+	}
+}
+
+/* Undo one recorded timer op. Timers put back are filed against the
+   wheel's tick at that point; game_timers_resync() refiles them once
+   the rewind is done.
+*/
+void game_timers_undo(P_GAME_TIMERS pgt, P_HIST_OP pop)
+{
+	P_TIMER pt;
+
+	switch(pop->op) {
+		case HIST_BOOST:
+			pgt->boost_delta = pop->value;
+			break;
+		case HIST_WHEEL:
+			pgt->wheel.now--;
+			break;
+		case HIST_TIMER:
+			pt = game_timer_by_id(pgt, pop->flag & ~HIST_TIMER_PENDING);
+			timer_cancel(pt);
+			if(pop->flag & HIST_TIMER_PENDING) {
+				timer_add_at(&pgt->wheel, pt, pgt->wheel.now + pop->value);
+			}
+			break;
+	}
+}
+
+void game_timers_resync(P_GAME_TIMERS pgt)
+{
+	P_TIMER timers[] = { &pgt->food, &pgt->boost, &pgt->portal };
+	int i;
+
+	for(i = 0; i < 3; i++) {
+		if(timer_pending(timers[i])) {
+			timer_add_at(&pgt->wheel, timers[i], timers[i]->expires);
+		}
+	}
+}
+
+/* Bot plugins
+ **************/
+
+static BOT bot;
+
+bool bot_load(const char *path, int accept_usec)
+{
+	const int *abi;
+
+	memset(&bot, 0, sizeof(bot));
+	bot.dl = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if( ! bot.dl) {
+		fprintf(stderr, "nsnake: %s\n", dlerror());
+		return false;
+	}
+
+	abi = dlsym(bot.dl, "nsnake_bot_abi");
+	bot.init = (nsnake_bot_init_fn)dlsym(bot.dl, "nsnake_bot_init");
+	bot.decide = (nsnake_bot_decide_fn)dlsym(bot.dl, "nsnake_bot_decide");
+	bot.free = (nsnake_bot_free_fn)dlsym(bot.dl, "nsnake_bot_free");
+	if( ! abi || *abi != NSNAKE_BOT_ABI || ! bot.init || ! bot.decide || ! bot.free) {
+		fprintf(stderr, "nsnake: %s is not a bot for ABI %d\n", path, NSNAKE_BOT_ABI);
+		dlclose(bot.dl);
+		bot.dl = NULL;
+		return false;
+	}
+
+	bot.accept = (accept_usec > 0 ? accept_usec : DEFAULT_BOT_ACCEPT) / 1e6;
+	return true;
+}
+
+/* Report decision timing and unload */
+void bot_unload()
+{
+	if( ! bot.dl) {
+		return;
+	}
+
+	fprintf(stderr, "bot: %lld decisions, avg %.2fus, max %.2fus, "
+		"%lld slower than the %.0fus accepted (discarded)\n",
+		bot.decisions,
+		bot.decisions ? bot.time_sum * 1e6 / bot.decisions : 0.0,
+		bot.time_max * 1e6, bot.late, bot.accept * 1e6);
+	dlclose(bot.dl);
+	bot.dl = NULL;
+}
+
+bool bot_loaded()
+{
+	return bot.dl != NULL;
+}
+
+static int bot_reach(const NSNAKE_VIEW *view, int dir)
+{
+	P_BOT_SEAT seat = view->host;
+
+	if(seat->penv) {
+		return batch_reach_dir(seat->penv, seat->g, dir);
+	}
+	return snake_reach_dir(seat->ws, seat->pset, seat->psnake, dir);
+}
+
+/* Point the parts of the view that do not move, then start the bot */
+static void bot_seat_init(P_BOT_SEAT seat, WINDOW_SNAKE *ws, P_SETTINGS pset)
+{
+	NSNAKE_VIEW *v = &seat->view;
+
+	v->abi = NSNAKE_BOT_ABI;
+	v->width = ws->plevel->width;
+	v->height = ws->plevel->height;
+	v->begx = ws->_begx;
+	v->begy = ws->_begy;
+	v->cells = ws->plevel->cells;
+	v->portal = pset->portal;
+	v->reverse = pset->reverse;
+	v->cheat = pset->cheat;
+	v->reach = bot_reach;
+	v->host = seat;
+	seat->ws = ws;
+	seat->pset = pset;
+}
+
+void bot_seat_snake(P_BOT_SEAT seat, WINDOW_SNAKE *ws, P_SETTINGS pset,
+		    P_SNAKE psnake, P_FOOD pfood)
+{
+	memset(seat, 0, sizeof(BOT_SEAT));
+	seat->psnake = psnake;
+	seat->pfood = pfood;
+	bot_seat_init(seat, ws, pset);
+	seat->view.occupied = psnake->occupied;
+	seat->state = bot.init(&seat->view);
+}
+
+void bot_seat_batch(P_BOT_SEAT seat, P_BATCH_ENV penv, int g)
+{
+	size_t base = (size_t)g * penv->cells;
+
+	memset(seat, 0, sizeof(BOT_SEAT));
+	seat->penv = penv;
+	seat->g = g;
+	bot_seat_init(seat, &penv->ws, &penv->settings);
+	seat->view.occupied = &penv->occupied[base];
+	seat->view.body = (const NSNAKE_COORD *)&penv->body[base];
+	seat->view.body_cap = penv->cells;
+	seat->state = bot.init(&seat->view);
+}
+
+void bot_seat_free(P_BOT_SEAT seat)
+{
+	bot.free(seat->state);
+	seat->state = NULL;
+}
+
+/* Bring the per-tick scalars up to date; arrays are shared, not copied */
+static void bot_view_sync(P_BOT_SEAT seat)
+{
+	NSNAKE_VIEW *v = &seat->view;
+	P_SNAKE psnake = seat->psnake;
+	P_BATCH_ENV penv = seat->penv;
+	int g = seat->g;
+
+	v->portal = seat->pset->portal;
+	v->reverse = seat->pset->reverse;
+	v->cheat = seat->pset->cheat;
+
+	if(penv) {
+		v->body_head = penv->head[g];
+		v->head.x = penv->head_x[g];
+		v->head.y = penv->head_y[g];
+		v->dir = penv->dir[g];
+		v->length = penv->length[g];
+		v->score = penv->score[g];
+		v->ticks = penv->ticks[g];
+		v->food_present = true;
+		v->food.x = penv->food_x[g];
+		v->food.y = penv->food_y[g];
+		v->hash = penv->zob[g].hash;
+		return;
+	}
+
+	/* The segment store may have been reallocated since last tick */
+	v->seg_count = psnake->segs.count;
+	v->seg_end_x = psnake->segs.end_x;
+	v->seg_end_y = psnake->segs.end_y;
+	v->seg_step_x = psnake->segs.step_x;
+	v->seg_step_y = psnake->segs.step_y;
+	v->seg_length = psnake->segs.length;
+	v->head.x = psnake->seg_head->coord_start.x;
+	v->head.y = psnake->seg_head->coord_start.y;
+	v->dir = psnake->seg_head->dir;
+	v->length = psnake->length;
+	v->score = psnake->score;
+	v->ticks = psnake->ticks;
+	v->food_present = ! seat->pfood->b_eaten;
+	v->food.x = seat->pfood->coord.x;
+	v->food.y = seat->pfood->coord.y;
+	v->hash = psnake->zob.hash;
+}
+
+/* Ask the bot for a move. Late or invalid answers count as no move.
+   The call is not preempted: the view points into live game state, so
+   decide() runs to completion on this thread, and a bot that never
+   returns stalls the game.
+*/
+direction_t bot_decide(P_BOT_SEAT seat)
+{
+	double t0, t;
+	int dir;
+
+	bot_view_sync(seat);
+
+	t0 = bench_now();
+	dir = bot.decide(seat->state, &seat->view);
+	t = bench_now() - t0;
+
+	bot.decisions++;
+	bot.time_sum += t;
+	if(t > bot.time_max) {
+		bot.time_max = t;
+	}
+	if(t > bot.accept) {
+		bot.late++;
+		return 0;
+	}
+
+	if(dir < DIR_LEFT || dir > DIR_DOWN_RIGHT || (dir & 1)) {
+		return 0;
+	}
+	return dir;
+}
+
+/* Rewind history
+ *****************/
+
+static HISTORY history;
+
+bool history_init(P_GAME_TIMERS pgt)
+{
+	memset(&history, 0, sizeof(history));
+	history.timers = pgt;
+	history.ops = calloc(HISTORY_LEN, sizeof(HIST_OP));
+	if( ! history.ops) {
+		return false;
+	}
+	history.enabled = true;
+	return true;
+}
+
+void history_free()
+{
+	free(history.ops);
+	memset(&history, 0, sizeof(history));
+}
+
+static P_HIST_OP history_push(hist_op_t op, int flag)
+{
+	P_HIST_OP pop;
+
+	if( ! history.enabled || history.replaying) {
+		return NULL;
+	}
+
+	/* Full: drop the oldest tick as a whole */
+	if(history.head - history.tail == HISTORY_LEN) {
+		do {
+			history.tail++;
+		} while(history.tail != history.head &&
+			history.ops[history.tail & (HISTORY_LEN - 1)].op != HIST_TICK);
+	}
+
+	pop = &history.ops[history.head++ & (HISTORY_LEN - 1)];
+	pop->op = op;
+	pop->flag = flag;
+	return pop;
+}
+
+void history_record(hist_op_t op, int flag, direction_t dir, P_COORD pc)
+{
+	P_HIST_OP pop = history_push(op, flag);
+
+	if(pop) {
+		pop->dir = dir;
+		if(pc) {
+			pop->coord = *pc;
+		}
+	}
+}
+
+void history_value(hist_op_t op, int flag, int value)
+{
+	P_HIST_OP pop = history_push(op, flag);
+
+	if(pop) {
+		pop->value = value;
+	}
+}
+
+bool history_last(hist_op_t op)
+{
+	return history.enabled && ! history.replaying && history.head != history.tail &&
+	       history.ops[(history.head - 1) & (HISTORY_LEN - 1)].op == op;
+}
+
+/* Drop the last op if it is op, for one that undoes it */
+bool history_cancel(hist_op_t op)
+{
+	if( ! history_last(op)) {
+		return false;
+	}
+	history.head--;
+	return true;
+}
+
+/* Redraw a cell uncovered or recovered by undo */
+static void history_draw_cell(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake,
+			      P_FOOD pfood, P_COORD pc)
+{
+	if(psnake->occupied[board_index(ws, pc)]) {
+		DRAW_SNAKE_HEAD(ws, pc->y, pc->x, pset->ch_draw);
+	}
+	else if( ! pfood->b_eaten && pc->x == pfood->coord.x && pc->y == pfood->coord.y) {
+		DRAW_ATTRON(COLOR_PAIR(COLOR_PAIR_FOOD));
+		DRAW_CHAR(ws, pc->y, pc->x, pset->ch_food);
+		DRAW_ATTROFF(COLOR_PAIR(COLOR_PAIR_FOOD));
+	}
+	else {
+		snake_erase_cell(ws, pset, psnake, pc);
+	}
+}
+
+/* Put back or take away one body cell with its bookkeeping */
+static void history_cell(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake,
+			 P_FOOD pfood, P_COORD pc, int delta)
+{
+	psnake->occupied[board_index(ws, pc)] += delta;
+	psnake->length += delta;
+	zobrist_toggle(&psnake->zob, pc);
+	history_draw_cell(ws, pset, psnake, pfood, pc);
+}
+
+static bool history_undo(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake,
+			 P_FOOD pfood, P_HIST_OP pop)
+{
+	P_SSEG head = psnake->seg_head;
+	P_SSEG tail = psnake->seg_tail;
+	P_SSEG seg;
+	COORD old;
+
+	switch(pop->op) {
+		case HIST_TICK:
+			psnake->ticks--;
+			break;
+		case HIST_HEAD_PUSH:
+			psnake->seg_head = head->next;
+			psnake->seg_head->previous = NULL;
+			psnake->seg_count--;
+			segstore_remove(&psnake->segs, head);
+			free(head);
+			break;
+		case HIST_HEAD_REPLACE:
+			head->dir = pop->dir;
+			head->coord_start = pop->coord;
+			head->coord_end = pop->coord;
+			segstore_sync(&psnake->segs, head);
+			break;
+		case HIST_HEAD_GROW:
+			old = head->coord_start;
+			head->length--;
+			if(pop->flag) {
+				seg_unupdate_headxy(head);
+			}
+			segstore_sync(&psnake->segs, head);
+			history_cell(ws, pset, psnake, pfood, &old, -1);
+			break;
+		case HIST_TAIL_SHRINK:
+			seg_update_coord(get_oppose_dir(tail->dir), &tail->coord_end);
+			tail->length++;
+			segstore_sync(&psnake->segs, tail);
+			history_cell(ws, pset, psnake, pfood, &tail->coord_end, 1);
+			break;
+		case HIST_TAIL_FREE:
+			seg = generate_new_head(pop->dir, &pop->coord);
+			if( ! seg || ! segstore_add(&psnake->segs, seg)) {
+				free(seg);
+				return false;
+			}
+			seg->length = 1;
+			seg->previous = tail;
+			tail->next = seg;
+			psnake->seg_tail = seg;
+			psnake->seg_count++;
+			segstore_sync(&psnake->segs, seg);
+			history_cell(ws, pset, psnake, pfood, &pop->coord, 1);
+			break;
+		case HIST_REVERSE:
+			reverse_snake(psnake);
+			break;
+		case HIST_EAT:
+			psnake->score--;
+			pfood->b_eaten = false;
+			break;
+		case HIST_FOOD:
+			old = pfood->coord;
+			pfood->coord = pop->coord;
+			pfood->b_eaten = pop->flag;
+			history_draw_cell(ws, pset, psnake, pfood, &old);
+			if( ! pfood->b_eaten) {
+				history_draw_cell(ws, pset, psnake, pfood, &pfood->coord);
+			}
+			break;
+		case HIST_SETTING:
+			switch(pop->flag) {
+				case HIST_SET_PORTAL:
+					pset->portal = pop->value;
+					break;
+				case HIST_SET_CHEAT:
+					pset->cheat = pop->value;
+					break;
+				case HIST_SET_REVERSE:
+					pset->reverse = pop->value;
+					break;
+			}
+			break;
+		case HIST_SPEED:
+			pset->speed = pop->value;
+			break;
+		case HIST_BOOST:
+		case HIST_WHEEL:
+		case HIST_TIMER:
+			game_timers_undo(history.timers, pop);
+			break;
+	}
+
+	return true;
+}
+
+/* Undo the last ticks moves, or as many as the history holds, with the
+   settings and game timers as they were. Costs O(ops undone), plus
+   O(segments) for each reversal, of which there is at most one per tick
+   undone. Returns the number of moves undone.
+*/
+int history_rewind(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake, P_FOOD pfood, int ticks)
+{
+	P_HIST_OP pop;
+	int undone = 0;
+
+	if( ! history.enabled) {
+		return 0;
+	}
+
+	history.replaying = true;
+	while(undone < ticks && history.head != history.tail) {
+		pop = &history.ops[(history.head - 1) & (HISTORY_LEN - 1)];
+		if( ! history_undo(ws, pset, psnake, pfood, pop)) {
+			break;
+		}
+		history.head--;
+		if(pop->op == HIST_TICK) {
+			undone++;
+		}
+	}
+	history.replaying = false;
+
+	game_timers_resync(history.timers);
+	psnake->reverse_tick = -1;
+	zobrist_head(&psnake->zob, &psnake->seg_head->coord_start, psnake->seg_head->dir);
+	zobrist_food(&psnake->zob, pfood->b_eaten ? NULL : &pfood->coord);
+	zobrist_settings(&psnake->zob, pset);
+	snake_check_trap(ws, pset, psnake);
+	return undone;
+}
+
+/* Reachable space
+ ******************/
+
+bool reach_init(P_REACH pr, int cells)
+{
+	pr->cells = cells;
+	pr->stamp = 0;
+	pr->mark = calloc(cells, sizeof(unsigned int));
+	pr->queue = calloc(cells, sizeof(COORD));
+	if( ! pr->mark || ! pr->queue) {
+		reach_free(pr);
+		return false;
+	}
+	return true;
+}
+
+void reach_free(P_REACH pr)
+{
+	free(pr->mark);
+	free(pr->queue);
+	pr->mark = NULL;
+	pr->queue = NULL;
+}
+
+/* The cell a head at from lands on moving in dir, through the border
+   (portal mode) and level portals the way snake_move() goes. Returns
+   false for walls, obstacles and a closed border.
+*/
+bool reach_next(WINDOW_SNAKE *ws, P_SETTINGS pset, P_COORD from, direction_t dir, P_COORD pc)
+{
+	unsigned char cell;
+
+	*pc = *from;
+	seg_update_coord(dir, pc);
+	if(is_coord_border(ws, pc)) {
+		if( ! pset->portal) {
+			return false;
+		}
+		portal_coord(ws, dir, from, pc);
+	}
+
+	cell = level_cell(ws, pc);
+	if(cell == CELL_WALL) {
+		return false;
+	}
+	if(cell >= CELL_PORTAL) {
+		level_portal_exit(ws, cell, pc);
+	}
+	return true;
+}
+
+/* Count free cells reachable from start, start included, in any of the
+   eight directions. The fill stops as soon as limit cells are found, so
+   a query costs O(limit) however large the board is. occ may be NULL to
+   ignore the body (cheat mode).
+*/
+int reach_count(WINDOW_SNAKE *ws, P_SETTINGS pset, P_REACH pr,
+		const unsigned char *occ, P_COORD start, int limit)
+{
+	static const direction_t dirs[] = {
+		DIR_LEFT, DIR_RIGHT, DIR_UP, DIR_DOWN,
+		DIR_UP_LEFT, DIR_UP_RIGHT, DIR_DOWN_LEFT, DIR_DOWN_RIGHT
+	};
+	static const signed char dx[] = { -1, 1, 0, 0, -1, 1, -1, 1 };
+	static const signed char dy[] = { 0, 0, -1, 1, -1, -1, 1, 1 };
+	unsigned char *cells = ws->plevel->cells;
+	int width = ws->plevel->width;
+	int head = 0, tail = 0, count = 0, d, i, x, y;
+	COORD next;
+
+	i = board_index(ws, start);
+	if(occ && occ[i]) {
+		return 0;
+	}
+
+	if( ! ++pr->stamp) {
+		memset(pr->mark, 0, pr->cells * sizeof(unsigned int));
+		pr->stamp = 1;
+	}
+
+	pr->mark[i] = pr->stamp;
+	pr->queue[tail++] = *start;
+	while(head < tail && ++count < limit) {
+		for(d = 0; d < 8; d++) {
+			/* Plain step inside the board, else the full rules */
+			x = pr->queue[head].x + dx[d] - ws->_begx;
+			y = pr->queue[head].y + dy[d] - ws->_begy;
+			i = y * width + x;
+			if((unsigned)x < (unsigned)width &&
+			   (unsigned)y < (unsigned)ws->plevel->height &&
+			   cells[i] == CELL_FREE) {
+				next.x = x + ws->_begx;
+				next.y = y + ws->_begy;
+			}
+			else {
+				if( ! reach_next(ws, pset, &pr->queue[head], dirs[d], &next)) {
+					continue;
+				}
+				i = board_index(ws, &next);
+			}
+			if(pr->mark[i] == pr->stamp || (occ && occ[i])) {
+				continue;
+			}
+			pr->mark[i] = pr->stamp;
+			pr->queue[tail++] = next;
+		}
+		head++;
+	}
+
+	return count;
+}
+
+/* Free cells the snake can reach after steering to dir and moving once,
+   counted up to its length. Less than the length means the move walks
+   into a pocket the snake cannot fit in. Steering against the current
+   direction reverses the snake or is ignored, as in snake_steer().
+*/
+int snake_reach_dir(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake, direction_t dir)
+{
+	P_SSEG from = psnake->seg_head;
+	P_COORD pfrom = &from->coord_start;
+	COORD next;
+
+	if(dir == get_oppose_dir(from->dir)) {
+		if(pset->reverse) {
+			from = psnake->seg_tail;
+			pfrom = &from->coord_end;
+			dir = get_oppose_dir(from->dir);
+		}
+		else {
+			dir = from->dir;
+		}
+	}
+
+	if( ! reach_next(ws, pset, pfrom, dir, &next)) {
+		return 0;
+	}
+	return reach_count(ws, pset, &psnake->reach,
+			   pset->cheat ? NULL : psnake->occupied,
+			   &next, psnake->length);
+}
+
+/* Re-evaluate the straight-ahead move after a tick; the status bar is
+   redrawn only when the warning changes
+*/
+void snake_check_trap(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake)
+{
+	bool trapped;
+
+	psnake->reach_ahead = snake_reach_dir(ws, pset, psnake, psnake->seg_head->dir);
+	trapped = psnake->reach_ahead < psnake->length;
+	if(trapped != psnake->trapped) {
+		psnake->trapped = trapped;
+		pset->b_altered = true;
+	}
+}
+
+/* Telemetry
+ ************/
+
+static TELEMETRY telemetry;
+
+void tick_stats_add(P_TICK_STATS pts, long long usec)
+{
+	if( ! pts->count || usec < pts->min) {
+		pts->min = usec;
+	}
+	if(usec > pts->max) {
+		pts->max = usec;
+	}
+	pts->sum += usec;
+	pts->count++;
+}
+
+term_cause_t snake_term_cause(P_SNAKE psnake)
+{
+	if(psnake->term_wall_collision)
+		return TERM_WALL;
+	if(psnake->term_obstacle_collision)
+		return TERM_OBSTACLE;
+	if(psnake->term_self_collision)
+		return TERM_SELF;
+	if(psnake->term_mem_alloc_fail)
+		return TERM_MEMORY;
+	if(psnake->term_user_choice)
+		return TERM_USER;
+	if(psnake->term_board_full)
+		return TERM_BOARD_FULL;
+	return TERM_NONE;
+}
+
+const char *term_cause_name(term_cause_t cause)
+{
+	switch(cause) {
+		case TERM_WALL:
+			return "wall";
+		case TERM_OBSTACLE:
+			return "obstacle";
+		case TERM_SELF:
+			return "self";
+		case TERM_MEMORY:
+			return "memory";
+		case TERM_USER:
+			return "user";
+		case TERM_BOARD_FULL:
+			return "board_full";
+		default:
+			return "none";
+	}
+}
+
+static void telemetry_write(const GAME_RECORD *prec)
+{
+	const char *tf[] = { "false", "true" };
+
+	if(telemetry.csv) {
+		fprintf(telemetry.fp, "%lld,%s,%d,%d,%d,%d,%s,%016llx,%d,%d,%d,%d,%d,%d,",
+			prec->time, prec->batch ? "batch" : "game",
+			prec->score, prec->length, prec->seg_count, prec->ticks,
+			term_cause_name(prec->cause), (unsigned long long)prec->hash,
+			prec->portal, prec->reverse, prec->cheat, prec->speed,
+			prec->board_width, prec->board_height);
+		if(prec->batch) {
+			fprintf(telemetry.fp, ",,\n");
+		}
+		else {
+			fprintf(telemetry.fp, "%lld,%.2f,%lld\n",
+				prec->tick_min_us, prec->tick_avg_us, prec->tick_max_us);
+		}
+		return;
+	}
+
+	if(prec->batch) {
+		fprintf(telemetry.fp,
+			"{\"time\":%lld,\"source\":\"batch\",\"score\":%d,\"length\":%d,"
+			"\"seg_count\":%d,\"ticks\":%d,\"cause\":\"%s\",\"hash\":\"%016llx\","
+			"\"portal\":%s,\"reverse\":%s,\"cheat\":%s,\"speed\":%d,"
+			"\"board\":[%d,%d],\"tick_us\":null}\n",
+			prec->time,
+			prec->score, prec->length, prec->seg_count, prec->ticks,
+			term_cause_name(prec->cause), (unsigned long long)prec->hash,
+			tf[prec->portal], tf[prec->reverse], tf[prec->cheat], prec->speed,
+			prec->board_width, prec->board_height);
+		return;
+	}
+
+	fprintf(telemetry.fp,
+		"{\"time\":%lld,\"source\":\"%s\",\"score\":%d,\"length\":%d,"
+		"\"seg_count\":%d,\"ticks\":%d,\"cause\":\"%s\",\"hash\":\"%016llx\","
+		"\"portal\":%s,\"reverse\":%s,\"cheat\":%s,\"speed\":%d,"
+		"\"board\":[%d,%d],"
+		"\"tick_us\":{\"min\":%lld,\"avg\":%.2f,\"max\":%lld}}\n",
+		prec->time, prec->batch ? "batch" : "game",
+		prec->score, prec->length, prec->seg_count, prec->ticks,
+		term_cause_name(prec->cause), (unsigned long long)prec->hash,
+		tf[prec->portal], tf[prec->reverse], tf[prec->cheat], prec->speed,
+		prec->board_width, prec->board_height,
+		prec->tick_min_us, prec->tick_avg_us, prec->tick_max_us);
+}
+
+static void *telemetry_thread(void *arg)
+{
+	struct timespec idle = { 0, TELEMETRY_IDLE_USEC * 1000 };
+	GAME_RECORD rec;
+
+	for(;;) {
+		if(spsc_pop(&telemetry.ring, &rec)) {
+			telemetry_write(&rec);
+			telemetry.written++;
+			continue;
+		}
+		/* Empty: stop if asked to, else flush and wait a little */
+		if(atomic_load(&telemetry.quit)) {
+			break;
+		}
+		fflush(telemetry.fp);
+		nanosleep(&idle, NULL);
+	}
+
+	fflush(telemetry.fp);
+	return NULL;
+}
+
+/* Append finished games to path; a .csv suffix selects CSV, anything
+   else JSON Lines. Batch rows leave the tick times empty (null).
+*/
+bool telemetry_open(const char *path)
+{
+	const char *dot = strrchr(path, '.');
+
+	memset(&telemetry, 0, sizeof(telemetry));
+	atomic_init(&telemetry.quit, false);
+	telemetry.csv = dot && ! strcmp(dot, ".csv");
+
+	telemetry.fp = fopen(path, "a");
+	if( ! telemetry.fp) {
+		return false;
+	}
+	if(telemetry.csv && ftell(telemetry.fp) == 0) {
+		fprintf(telemetry.fp, "time,source,score,length,seg_count,ticks,cause,hash,"
+			"portal,reverse,cheat,speed,board_width,board_height,"
+			"tick_min_us,tick_avg_us,tick_max_us\n");
+	}
+
+	if( ! spsc_init(&telemetry.ring, sizeof(GAME_RECORD), TELEMETRY_RING_LEN)) {
+		fclose(telemetry.fp);
+		return false;
+	}
+	if(pthread_create(&telemetry.thread, NULL, telemetry_thread, NULL)) {
+		spsc_free(&telemetry.ring);
+		fclose(telemetry.fp);
+		return false;
+	}
+
+	telemetry.running = true;
+	return true;
+}
+
+/* Write out everything queued, then stop the writer */
+void telemetry_close()
+{
+	if( ! telemetry.running) {
+		return;
+	}
+
+	atomic_store(&telemetry.quit, true);
+	pthread_join(telemetry.thread, NULL);
+	spsc_free(&telemetry.ring);
+	fclose(telemetry.fp);
+	telemetry.running = false;
+
+	if(telemetry.dropped) {
+		fprintf(stderr, "nsnake: telemetry dropped %lld of %lld records\n",
+			telemetry.dropped, telemetry.dropped + telemetry.written);
+	}
+}
+
+bool telemetry_enabled()
+{
+	return telemetry.running;
+}
+
+/* Queue a record; never waits, drops it if the writer has fallen behind */
+void telemetry_submit(const GAME_RECORD *prec)
+{
+	if( ! telemetry.running) {
+		return;
+	}
+	if( ! spsc_push(&telemetry.ring, prec)) {
+		telemetry.dropped++;
+	}
+}
+
+/* High scores
+ **************/
+
+static SCORES scores;
+
+/* Games only compete with games played under the same rules */
+unsigned int scores_profile(const GAME_RECORD *prec)
+{
+	unsigned int w = prec->board_width > 0xfff ? 0xfff : prec->board_width;
+	unsigned int h = prec->board_height > 0xfff ? 0xfff : prec->board_height;
+
+	return (w << 20) | (h << 8) | ((prec->speed & 0x3f) << 2) |
+	       (prec->reverse << 1) | prec->portal;
+}
+
+/* Index order: profile, then score from the highest, then oldest first */
+static int scores_key_cmp(const void *a, const void *b)
+{
+	const SCORE_KEY *x = a, *y = b;
+
+	if(x->profile != y->profile) {
+		return x->profile < y->profile ? -1 : 1;
+	}
+	if(x->score != y->score) {
+		return x->score > y->score ? -1 : 1;
+	}
+	return (x->record > y->record) - (x->record < y->record);
+}
+
+/* Number of whole records in the store; a record torn by a crash in
+   the middle of an append is not counted
+*/
+static long long scores_records(off_t size)
+{
+	if(size < sizeof(SCORE_HEADER)) {
+		return 0;
+	}
+	return (size - sizeof(SCORE_HEADER)) / sizeof(SCORE_ENTRY);
+}
+
+/* Map a whole file read-only; *psize is 0 and NULL returned if empty */
+static void *scores_map(int fd, size_t *psize)
+{
+	struct stat st;
+	void *base;
+
+	*psize = 0;
+	if(fstat(fd, &st) < 0 || st.st_size == 0) {
+		return NULL;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if(base == MAP_FAILED) {
+		return NULL;
+	}
+	*psize = st.st_size;
+	return base;
+}
+
+/* Map the index and return its keys, or NULL when missing, stale or
+   damaged. Called with the store locked.
+*/
+static const SCORE_KEY *scores_index_map(long long n_records, void **pbase,
+					 size_t *psize, long long *pcount)
+{
+	const SCORE_HEADER *phdr;
+	int fd;
+
+	*pcount = 0;
+	fd = open(scores.idx_path, O_RDONLY);
+	if(fd < 0) {
+		*pbase = NULL;
+		return NULL;
+	}
+	*pbase = scores_map(fd, psize);
+	close(fd);
+	if( ! *pbase) {
+		return NULL;
+	}
+
+	phdr = *pbase;
+	if(*psize < sizeof(SCORE_HEADER) ||
+	   memcmp(phdr->magic, SCORES_INDEX_MAGIC, 4) ||
+	   phdr->version != SCORES_VERSION ||
+	   phdr->count > n_records ||
+	   *psize < sizeof(SCORE_HEADER) + phdr->count * sizeof(SCORE_KEY)) {
+		munmap(*pbase, *psize);
+		*pbase = NULL;
+		return NULL;
+	}
+
+	*pcount = phdr->count;
+	return (const SCORE_KEY *)(phdr + 1);
+}
+
+/* Fold the unindexed tail of the store into a new index: sort the tail
+   keys and merge them with the old index in one pass. The new index is
+   renamed into place, so readers see the old one or the new one, never
+   a mix. Called with the store locked exclusively.
+*/
+static bool scores_reindex(const SCORE_ENTRY *records, long long n_records)
+{
+	const SCORE_KEY *old = NULL;
+	void *old_base = NULL;
+	size_t old_size = 0;
+	long long n_old, n_tail, i, j;
+	SCORE_KEY *tail = NULL;
+	SCORE_HEADER hdr;
+	FILE *fp = NULL;
+	bool ok = false;
+
+	old = scores_index_map(n_records, &old_base, &old_size, &n_old);
+	n_tail = n_records - n_old;
+	tail = malloc(n_tail * sizeof(SCORE_KEY));
+	if( ! tail) {
+		goto out;
+	}
+	for(i = 0; i < n_tail; i++) {
+		tail[i].profile = records[n_old + i].profile;
+		tail[i].score = records[n_old + i].score;
+		tail[i].record = n_old + i;
+	}
+	qsort(tail, n_tail, sizeof(SCORE_KEY), scores_key_cmp);
+
+	fp = fopen(scores.tmp_path, "wb");
+	if( ! fp) {
+		goto out;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SCORES_INDEX_MAGIC, 4);
+	hdr.version = SCORES_VERSION;
+	hdr.count = n_records;
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+
+	for(i = 0, j = 0; i < n_old || j < n_tail; ) {
+		if(j == n_tail || (i < n_old && scores_key_cmp(&old[i], &tail[j]) < 0)) {
+			fwrite(&old[i++], sizeof(SCORE_KEY), 1, fp);
+		}
+		else {
+			fwrite(&tail[j++], sizeof(SCORE_KEY), 1, fp);
+		}
+	}
+
+	if(fclose(fp) != 0) {
+		fp = NULL;
+		unlink(scores.tmp_path);
+		goto out;
+	}
+	fp = NULL;
+	ok = rename(scores.tmp_path, scores.idx_path) == 0;
+
+out:
+	if(fp) {
+		fclose(fp);
+		unlink(scores.tmp_path);
+	}
+	if(old_base) {
+		munmap(old_base, old_size);
+	}
+	free(tail);
+	return ok;
+}
+
+bool scores_open(const char *path)
+{
+	SCORE_HEADER hdr;
+	struct stat st;
+	size_t len = strlen(path);
+	bool ok = false;
+
+	memset(&scores, 0, sizeof(scores));
+	scores.path = strdup(path);
+	scores.idx_path = malloc(len + sizeof(".idx"));
+	scores.tmp_path = malloc(len + sizeof(".idx.tmp"));
+	scores.pending = calloc(SCORES_BATCH, sizeof(SCORE_ENTRY));
+	if( ! scores.path || ! scores.idx_path || ! scores.tmp_path || ! scores.pending) {
+		goto fail;
+	}
+	sprintf(scores.idx_path, "%s.idx", path);
+	sprintf(scores.tmp_path, "%s.idx.tmp", path);
+
+	scores.fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+	if(scores.fd < 0) {
+		goto fail;
+	}
+
+	/* A new store gets its header, an existing one must be ours */
+	flock(scores.fd, LOCK_EX);
+	if(fstat(scores.fd, &st) == 0) {
+		if(st.st_size == 0) {
+			memset(&hdr, 0, sizeof(hdr));
+			memcpy(hdr.magic, SCORES_MAGIC, 4);
+			hdr.version = SCORES_VERSION;
+			ok = write(scores.fd, &hdr, sizeof(hdr)) == sizeof(hdr);
+		}
+		else {
+			ok = pread(scores.fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+			     ! memcmp(hdr.magic, SCORES_MAGIC, 4) &&
+			     hdr.version == SCORES_VERSION;
+			if( ! ok) {
+				errno = EINVAL;
+			}
+		}
+	}
+	flock(scores.fd, LOCK_UN);
+	if( ! ok) {
+		close(scores.fd);
+		goto fail;
+	}
+
+	scores.running = true;
+	return true;
+
+fail:
+	free(scores.path);
+	free(scores.idx_path);
+	free(scores.tmp_path);
+	free(scores.pending);
+	return false;
+}
+
+/* Append the buffered games in one write. The tail is folded into the
+   index once it outgrows SCORES_TAIL_MAX and an eighth of the index, so
+   the rewrites stay linear in the store size; fold drops the second
+   condition, leaving a short tail for the next reader.
+*/
+bool scores_flush(bool fold)
+{
+	const SCORE_ENTRY *records;
+	void *base, *idx_base;
+	size_t size, len;
+	struct stat st;
+	long long n_records, n_indexed = 0;
+	off_t start;
+	bool ok;
+
+	if( ! scores.running || ! scores.n_pending) {
+		return true;
+	}
+
+	flock(scores.fd, LOCK_EX);
+
+	/* Drop a record torn by a writer that died half way */
+	if(fstat(scores.fd, &st) < 0) {
+		flock(scores.fd, LOCK_UN);
+		return false;
+	}
+	n_records = scores_records(st.st_size);
+	start = sizeof(SCORE_HEADER) + n_records * sizeof(SCORE_ENTRY);
+	if(st.st_size != start && ftruncate(scores.fd, start) < 0) {
+		flock(scores.fd, LOCK_UN);
+		return false;
+	}
+
+	/* A failed or short write is cut back off and the games are kept
+	   for the next flush, so a retry cannot append them twice
+	*/
+	len = scores.n_pending * sizeof(SCORE_ENTRY);
+	ok = write(scores.fd, scores.pending, len) == len;
+	if(ok) {
+		scores.n_pending = 0;
+	}
+	else {
+		/* If even this fails, a retry may append some games twice */
+		ftruncate(scores.fd, start);
+	}
+
+	base = ok ? scores_map(scores.fd, &size) : NULL;
+	if(base) {
+		records = (const SCORE_ENTRY *)((const SCORE_HEADER *)base + 1);
+		n_records = scores_records(size);
+		if(scores_index_map(n_records, &idx_base, &len, &n_indexed)) {
+			munmap(idx_base, len);
+		}
+		if(n_records - n_indexed > SCORES_TAIL_MAX &&
+		   (fold || n_records - n_indexed > n_indexed / 8)) {
+			scores_reindex(records, n_records);
+		}
+		munmap(base, size);
+	}
+
+	flock(scores.fd, LOCK_UN);
+	return ok;
+}
+
+/* Print the best games of the last profile played, then close */
+void scores_close()
+{
+	SCORE_ENTRY top[SCORES_TOP];
+	unsigned int p = scores.profile;
+	char when[32];
+	int i, n;
+
+	if( ! scores.running) {
+		return;
+	}
+
+	if( ! scores_flush(true)) {
+		fprintf(stderr, "nsnake: could not write %s, %d games lost\n",
+			scores.path, scores.n_pending);
+	}
+	if(scores.dropped) {
+		fprintf(stderr, "nsnake: %lld games not recorded, %s could not be written\n",
+			scores.dropped, scores.path);
+	}
+
+	if(scores.has_profile) {
+		n = scores_top(p, top, SCORES_TOP);
+		printf("High scores, %dx%d speed %d%s%s:\n", p >> 20, (p >> 8) & 0xfff,
+		       (p >> 2) & 0x3f, (p & 2) ? " reverse" : "", (p & 1) ? " portal" : "");
+		for(i = 0; i < n; i++) {
+			strftime(when, sizeof(when), "%Y-%m-%d %H:%M",
+				 localtime(&(time_t){ top[i].time }));
+			printf("%c%2d. %6d  length %-5d %s  %s\n",
+			       ! memcmp(&top[i], &scores.last, sizeof(SCORE_ENTRY)) ? '*' : ' ',
+			       i + 1, top[i].score, top[i].length, when,
+			       top[i].batch ? "batch" : "game");
+		}
+	}
+
+	close(scores.fd);
+	free(scores.path);
+	free(scores.idx_path);
+	free(scores.tmp_path);
+	free(scores.pending);
+	scores.running = false;
+}
+
+bool scores_enabled()
+{
+	return scores.running;
+}
+
+/* Buffer a finished game. Cheat games are shown the table but do not
+   go into it.
+*/
+void scores_submit(const GAME_RECORD *prec)
+{
+	P_SCORE_ENTRY pe;
+
+	if( ! scores.running) {
+		return;
+	}
+
+	scores.has_profile = true;
+	scores.profile = scores_profile(prec);
+	if(prec->cheat) {
+		return;
+	}
+
+	/* Still full after a failed flush */
+	if(scores.n_pending == SCORES_BATCH && ! scores_flush(false)) {
+		scores.dropped++;
+		return;
+	}
+
+	pe = &scores.pending[scores.n_pending++];
+	memset(pe, 0, sizeof(SCORE_ENTRY));
+	pe->time = prec->time;
+	pe->hash = prec->hash;
+	pe->profile = scores.profile;
+	pe->score = prec->score;
+	pe->length = prec->length;
+	pe->ticks = prec->ticks;
+	pe->cause = prec->cause;
+	pe->batch = prec->batch;
+	if( ! prec->batch) {
+		scores.last = *pe;
+	}
+
+	if(scores.n_pending == SCORES_BATCH) {
+		scores_flush(false);
+	}
+}
+
+/* Best n games of a profile into top[], returns how many. The index
+   gives them by binary search; the few records appended since it was
+   built are scanned and merged in.
+*/
+int scores_top(unsigned int profile, P_SCORE_ENTRY top, int n)
+{
+	const SCORE_ENTRY *records;
+	const SCORE_KEY *keys;
+	SCORE_KEY best[SCORES_TOP * 2], k;
+	void *base, *idx_base = NULL;
+	size_t size, idx_size = 0;
+	long long n_records, n_indexed, lo, hi, mid, r;
+	int i, found = 0, from_index = 0;
+
+	if(n > SCORES_TOP) {
+		n = SCORES_TOP;
+	}
+
+	flock(scores.fd, LOCK_SH);
+	base = scores_map(scores.fd, &size);
+	if( ! base) {
+		flock(scores.fd, LOCK_UN);
+		return 0;
+	}
+	records = (const SCORE_ENTRY *)((const SCORE_HEADER *)base + 1);
+	n_records = scores_records(size);
+
+	keys = scores_index_map(n_records, &idx_base, &idx_size, &n_indexed);
+	if(keys) {
+		for(lo = 0, hi = n_indexed; lo < hi; ) {
+			mid = lo + (hi - lo) / 2;
+			if(keys[mid].profile < profile) {
+				lo = mid + 1;
+			}
+			else {
+				hi = mid;
+			}
+		}
+		for(; lo < n_indexed && from_index < n && keys[lo].profile == profile; lo++) {
+			best[from_index++] = keys[lo];
+		}
+	}
+
+	/* Keep the best n of the tail by insertion behind the index ones */
+	for(r = n_indexed; r < n_records; r++) {
+		if(records[r].profile != profile) {
+			continue;
+		}
+		k.profile = profile;
+		k.score = records[r].score;
+		k.record = r;
+		for(i = from_index + found;
+		    i > from_index && scores_key_cmp(&k, &best[i - 1]) < 0; i--) {
+			if(i < from_index + n) {
+				best[i] = best[i - 1];
+			}
+		}
+		if(i < from_index + n) {
+			best[i] = k;
+			if(found < n) {
+				found++;
+			}
+		}
+	}
+
+	qsort(best, from_index + found, sizeof(SCORE_KEY), scores_key_cmp);
+	found = from_index + found < n ? from_index + found : n;
+	for(i = 0; i < found; i++) {
+		top[i] = records[best[i].record];
+	}
+
+	if(idx_base) {
+		munmap(idx_base, idx_size);
+	}
+	munmap(base, size);
+	flock(scores.fd, LOCK_UN);
+	return found;
+}
+
+/* Heatmap
+ **********/
+
+static const char *heatmap_path;
+
+/* Where heatmap_write() goes; NULL turns it off */
+void heatmap_setup(const char *path)
+{
+	heatmap_path = path;
+}
+
+/* Shade every free cell after 't', or blank it again */
+void heatmap_draw(WINDOW_SNAKE *ws, P_SETTINGS pset, P_SNAKE psnake, P_FOOD pfood)
+{
+	COORD c;
+
+	for(c.y = ws->_begy; c.y < ws->_begy + ws->plevel->height; c.y++) {
+		for(c.x = ws->_begx; c.x < ws->_begx + ws->plevel->width; c.x++) {
+			if(psnake->occupied[board_index(ws, &c)] ||
+			   level_cell(ws, &c) != CELL_FREE ||
+			   ( ! pfood->b_eaten && c.x == pfood->coord.x && c.y == pfood->coord.y)) {
+				continue;
+			}
+			snake_erase_cell(ws, pset, psnake, &c);
+		}
+	}
+}
+
+/* Save visit counts as a binary PGM, 8 or 16 bits deep as the largest
+   count needs. Counts beyond 16 bits are scaled down.
+*/
+bool heatmap_write(const unsigned int *visits, int width, int height)
+{
+	unsigned char *row = NULL;
+	unsigned int max = 0, maxval, v;
+	int i, x, y, depth;
+	FILE *fp;
+	bool ok;
+
+	if( ! heatmap_path) {
+		return true;
+	}
+
+	for(i = 0; i < width * height; i++) {
+		if(visits[i] > max) {
+			max = visits[i];
+		}
+	}
+	maxval = max > 0xffff ? 0xffff : (max ? max : 1);
+	depth = maxval > 0xff ? 2 : 1;
+
+	fp = fopen(heatmap_path, "wb");
+	row = malloc(width * depth);
+	if( ! fp || ! row) {
+		if(fp) {
+			fclose(fp);
+		}
+		free(row);
+		return false;
+	}
+
+	fprintf(fp, "P5\n# nsnake cell visits, most %u\n%d %d\n%u\n",
+		max, width, height, maxval);
+	for(y = 0; y < height; y++) {
+		for(x = 0; x < width; x++) {
+			v = visits[y * width + x];
+			if(max > maxval) {
+				v = (unsigned long long)v * maxval / max;
+			}
+			/* 16 bit samples are big-endian */
+			if(depth == 2) {
+				row[x * 2] = v >> 8;
+				row[x * 2 + 1] = v & 0xff;
+			}
+			else {
+				row[x] = v;
+			}
+		}
+		fwrite(row, depth, width, fp);
+	}
+
+	ok = fclose(fp) == 0;
+	free(row);
+	return ok;
+}
+
+/* Sound
+ ********/
+
+static SOUND sound;
+
+/* Ring the terminal bell directly. A BEL landing in the middle of an
+   escape sequence written by ncurses is executed without disturbing it,
+   so this is safe to do from the helper thread.
+*/
+static void sound_bell()
+{
+	ssize_t ignored = write(STDOUT_FILENO, "\a", 1);
+
+	(void)ignored;
+}
+
+static void *sound_thread(void *arg)
+{
+	sound_event_t event;
+
+	pthread_mutex_lock(&sound.lock);
+	for(;;) {
+		while( ! sound.q_count && ! sound.quit) {
+			pthread_cond_wait(&sound.cond, &sound.lock);
+		}
+		if( ! sound.q_count) {
+			break;
+		}
+		event = sound.queue[sound.q_head];
+		sound.q_head = (sound.q_head + 1) % SOUND_QUEUE_LEN;
+		sound.q_count--;
+
+		/* Play without holding the lock */
+		pthread_mutex_unlock(&sound.lock);
+		switch(event) {
+			case SOUND_EAT:
+			case SOUND_GAME_OVER:
+				sound_bell();
+				break;
+			default:
+				break;
+		}
+		pthread_mutex_lock(&sound.lock);
+	}
+	pthread_mutex_unlock(&sound.lock);
+
+	return NULL;
+}
+
+bool sound_init()
+{
+	memset(&sound, 0, sizeof(sound));
+	pthread_mutex_init(&sound.lock, NULL);
+	pthread_cond_init(&sound.cond, NULL);
+
+	if(pthread_create(&sound.thread, NULL, sound_thread, NULL)) {
+		return false;
+	}
+
+	sound.running = true;
+	return true;
+}
+
+/* Let queued sounds finish, then stop the helper */
+void sound_uninit()
+{
+	if( ! sound.running) {
+		return;
+	}
+
+	pthread_mutex_lock(&sound.lock);
+	sound.quit = true;
+	pthread_cond_signal(&sound.cond);
+	pthread_mutex_unlock(&sound.lock);
+
+	pthread_join(sound.thread, NULL);
+	sound.running = false;
+}
+
+/* Queue a sound. Events of one kind arriving faster than their minimum
+   interval, or finding the queue full, are dropped rather than waited on.
+*/
+void sound_play(sound_event_t event)
+{
+	static const long long min_interval[SOUND_EVENT_COUNT] = {
+		[SOUND_EAT] = SOUND_EAT_INTERVAL,
+		[SOUND_GAME_OVER] = 0,
+	};
+	long long now = now_usec();
+
+	if( ! sound.running) {
+		beep();
+		return;
+	}
+
+	if(sound.last_queued[event] &&
+	   now - sound.last_queued[event] < min_interval[event]) {
+		return;
+	}
+
+	pthread_mutex_lock(&sound.lock);
+	if(sound.q_count < SOUND_QUEUE_LEN) {
+		sound.queue[(sound.q_head + sound.q_count) % SOUND_QUEUE_LEN] = event;
+		sound.q_count++;
+		sound.last_queued[event] = now;
+		pthread_cond_signal(&sound.cond);
+	}
+	pthread_mutex_unlock(&sound.lock);
+}
+
+/* Level / collision map
+ ************************/
+
+bool level_init(WINDOW_SNAKE *ws)
+{
+	P_LEVEL plevel = NULL;
+
+	plevel = calloc(sizeof(LEVEL), 1);
+	if( ! plevel) {
+		return false;
+	}
+
+	plevel->width = ws->_maxx - ws->_begx + 1;
+	plevel->height = ws->_maxy - ws->_begy + 1;
+	plevel->cells = calloc(plevel->width * plevel->height, 1);
+	if( ! plevel->cells) {
+		free(plevel);
+		return false;
+	}
+
+	ws->plevel = plevel;
+	return true;
+}
+
+void level_free(WINDOW_SNAKE *ws)
+{
+	if( ! ws->plevel) {
+		return;
+	}
+	free(ws->plevel->cells);
+	free(ws->plevel);
+	ws->plevel = NULL;
+}
+
+/* Map the level file and merge it into the collision map.
+   Walls are stored as row-major runs, so loading costs one memset
+   per run rather than a parse per cell. A level larger than the
+   board is clipped, a smaller one is placed at the top left.
+*/
+bool level_load(WINDOW_SNAKE *ws, const char *path)
+{
+	P_LEVEL plevel = ws->plevel;
+	const LEVEL_HEADER *phdr = NULL;
+	const LEVEL_PORTAL *pportal = NULL;
+	const LEVEL_RUN *prun = NULL;
+	unsigned char *base = NULL;
+	struct stat st;
+	size_t need;
+	long cell, end, row_end;
+	int fd, i, x, y, n, w, width, height;
+	unsigned int n_runs;
+	bool ok = false;
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		return false;
+	}
+	if(fstat(fd, &st) < 0 || st.st_size < sizeof(LEVEL_HEADER)) {
+		close(fd);
+		return false;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(base == MAP_FAILED) {
+		return false;
+	}
+
+	phdr = (const LEVEL_HEADER *)base;
+	width = le16toh(phdr->width);
+	height = le16toh(phdr->height);
+	n_runs = le32toh(phdr->n_runs);
+	need = sizeof(LEVEL_HEADER) +
+	       phdr->n_portals * sizeof(LEVEL_PORTAL) +
+	       (size_t)n_runs * sizeof(LEVEL_RUN);
+	if(memcmp(phdr->magic, LEVEL_MAGIC, 4) || 
+	   phdr->version != LEVEL_VERSION ||
+	   phdr->n_portals > MAX_PORTAL_ENDPOINTS ||
+	   (phdr->n_portals & 1) ||
+	   need > st.st_size) {
+		goto out;
+	}
+
+	pportal = (const LEVEL_PORTAL *)(phdr + 1);
+	prun = (const LEVEL_RUN *)(pportal + phdr->n_portals);
+
+	/* Replay the runs, clipping each against the board */
+	cell = 0;
+	end = (long)width * height;
+	for(i = 0; i < n_runs && cell < end; i++) {
+		n = le16toh(prun[i].count);
+		if(prun[i].cell != CELL_WALL) {
+			cell += n;
+			continue;
+		}
+		while(n > 0 && cell < end) {
+			y = cell / width;
+			x = cell % width;
+			row_end = width - x;
+			w = n < row_end ? n : row_end;
+			if(y < plevel->height && x < plevel->width) {
+				memset(&plevel->cells[y * plevel->width + x], CELL_WALL,
+				       (x + w > plevel->width) ? plevel->width - x : w);
+			}
+			cell += w;
+			n -= w;
+		}
+	}
+
+	/* Drop in portal endpoints; a pair with an off-board end is ignored */
+	plevel->n_portals = 0;
+	for(i = 0; i + 1 < phdr->n_portals; i += 2) {
+		if(le16toh(pportal[i].x) >= plevel->width ||
+		   le16toh(pportal[i].y) >= plevel->height ||
+		   le16toh(pportal[i+1].x) >= plevel->width ||
+		   le16toh(pportal[i+1].y) >= plevel->height) {
+			continue;
+		}
+		for(n = 0; n < 2; n++) {
+			x = le16toh(pportal[i+n].x);
+			y = le16toh(pportal[i+n].y);
+			plevel->portals[plevel->n_portals].x = x + ws->_begx;
+			plevel->portals[plevel->n_portals].y = y + ws->_begy;
+			plevel->cells[y * plevel->width + x] = CELL_PORTAL + plevel->n_portals;
+			plevel->n_portals++;
+		}
+	}
+
+	ok = true;
+out:
+	munmap(base, st.st_size);
+	return ok;
+}
+
+/* Convert an ASCII level into the binary format loaded by level_load().
+   '#' is a wall, a letter marks one end of a portal (each letter must
+   appear exactly twice), anything else is free space.
+*/
+/* Runs are counted in host order and stored little-endian */
+static void level_put_run(FILE *dst, const LEVEL_RUN *prun)
+{
+	LEVEL_RUN run = *prun;
+
+	run.count = htole16(run.count);
+	fwrite(&run, sizeof(run), 1, dst);
+}
+
+bool level_compile(const char *src_path, const char *dst_path)
+{
+	FILE *src = NULL, *dst = NULL;
+	char line[LEVEL_SRC_COLS + 3];	/* CR LF NUL */
+	char *rows[LEVEL_SRC_ROWS];
+	int width = 0, height = 0;
+	int x, y, len;
+	unsigned int n_runs = 0;
+	LEVEL_HEADER hdr;
+	LEVEL_PORTAL ends[2][26];
+	int end_count[26];
+	LEVEL_RUN run;
+	unsigned char cell;
+	bool ok = false;
+
+	src = fopen(src_path, "r");
+	if( ! src) {
+		perror(src_path);
+		return false;
+	}
+
+	/* Refuse what fgets() would split or drop rather than compile a
+	   different level
+	*/
+	while(fgets(line, sizeof(line), src)) {
+		/* Without a newline, fgets() stopped at the end of the file
+		   or at the end of the buffer
+		*/
+		len = strcspn(line, "\r\n");
+		if(len > LEVEL_SRC_COLS || ( ! strchr(line, '\n') && ! feof(src))) {
+			fprintf(stderr, "nsnake: %s:%d: line longer than %d characters\n",
+				src_path, height + 1, LEVEL_SRC_COLS);
+			goto out;
+		}
+		if(height == LEVEL_SRC_ROWS) {
+			fprintf(stderr, "nsnake: %s: more than %d rows\n",
+				src_path, LEVEL_SRC_ROWS);
+			goto out;
+		}
+		line[len] = '\0';
+		rows[height] = strdup(line);
+		if( ! rows[height]) {
+			perror(src_path);
+			goto out;
+		}
+		height++;
+		if(len > width) {
+			width = len;
+		}
+	}
+	fclose(src);
+	src = NULL;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memset(end_count, 0, sizeof(end_count));
+	memcpy(hdr.magic, LEVEL_MAGIC, 4);
+	hdr.version = LEVEL_VERSION;
+	hdr.width = htole16(width);
+	hdr.height = htole16(height);
+
+	for(y = 0; y < height; y++) {
+		len = strlen(rows[y]);
+		for(x = 0; x < len; x++) {
+			if( ! isalpha((unsigned char)rows[y][x])) {
+				continue;
+			}
+			cell = tolower((unsigned char)rows[y][x]) - 'a';
+			if(end_count[cell] >= 2) {
+				fprintf(stderr, "nsnake: portal '%c' used more than twice\n",
+					rows[y][x]);
+				goto out;
+			}
+			ends[end_count[cell]][cell].x = htole16(x);
+			ends[end_count[cell]][cell].y = htole16(y);
+			end_count[cell]++;
+		}
+	}
+
+	dst = fopen(dst_path, "wb");
+	if( ! dst) {
+		perror(dst_path);
+		goto out;
+	}
+
+	/* Header is rewritten once the run count is known */
+	for(x = 0; x < 26; x++) {
+		if(end_count[x] == 2) {
+			hdr.n_portals += 2;
+		}
+	}
+	fwrite(&hdr, sizeof(hdr), 1, dst);
+	for(x = 0; x < 26; x++) {
+		if(end_count[x] == 2) {
+			fwrite(&ends[0][x], sizeof(LEVEL_PORTAL), 1, dst);
+			fwrite(&ends[1][x], sizeof(LEVEL_PORTAL), 1, dst);
+		}
+	}
+
+	memset(&run, 0, sizeof(run));
+	run.cell = CELL_FREE;
+	for(y = 0; y < height; y++) {
+		len = strlen(rows[y]);
+		for(x = 0; x < width; x++) {
+			cell = (x < len && rows[y][x] == '#') ? CELL_WALL : CELL_FREE;
+			if(cell != run.cell || run.count == 0xffff) {
+				if(run.count) {
+					level_put_run(dst, &run);
+					n_runs++;
+				}
+				run.cell = cell;
+				run.count = 0;
+			}
+			run.count++;
+		}
+	}
+	if(run.count) {
+		level_put_run(dst, &run);
+		n_runs++;
+	}
+
+	rewind(dst);
+	hdr.n_runs = htole32(n_runs);
+	fwrite(&hdr, sizeof(hdr), 1, dst);
+	ok = (fclose(dst) == 0);
+
+out:
+	if(src) {
+		fclose(src);
+	}
+	for(y = 0; y < height; y++) {
+		free(rows[y]);
+	}
+	return ok;
+}
+
+void level_draw(WINDOW_SNAKE *ws)
+{
+	P_LEVEL plevel = ws->plevel;
+	int x, y;
+
+	for(y = 0; y < plevel->height; y++) {
+		for(x = 0; x < plevel->width; x++) {
+			level_draw_cell(ws, y + ws->_begy, x + ws->_begx,
+					plevel->cells[y * plevel->width + x]);
+		}
+	}
+}
+
+/* Draw the obstacle or portal glyph of one level cell */
+void level_draw_cell(WINDOW_SNAKE *ws, int y, int x, unsigned char cell)
+{
+	if(cell == CELL_WALL) {
+		DRAW_ATTRON(COLOR_PAIR(COLOR_PAIR_BOX));
+		DRAW_CHAR(ws, y, x, DEFAULT_WALL_CHAR);
+		DRAW_ATTROFF(COLOR_PAIR(COLOR_PAIR_BOX));
+	}
+	else if(cell >= CELL_PORTAL) {
+		DRAW_ATTRON(COLOR_PAIR(COLOR_PAIR_PORTAL));
+		DRAW_CHAR(ws, y, x, DEFAULT_PORTAL_CHAR);
+		DRAW_ATTROFF(COLOR_PAIR(COLOR_PAIR_PORTAL));
+	}
+}
+
+unsigned char level_cell(WINDOW_SNAKE *ws, P_COORD pc)
+{
+	if(is_coord_border(ws, pc)) {
+		return CELL_WALL;
+	}
+
+	return ws->plevel->cells[board_index(ws, pc)];
+}
+
+bool level_portal_exit(WINDOW_SNAKE *ws, unsigned char cell, P_COORD pc)
+{
+	int endpoint = cell - CELL_PORTAL;
+
+	if(cell < CELL_PORTAL || endpoint >= ws->plevel->n_portals) {
+		return false;
+	}
+
+	*pc = ws->plevel->portals[endpoint ^ 1];
+	return true;
+}
+
+/* Segment store
+ ****************/
+
+bool segstore_init(P_SEG_STORE pstore)
+{
+	memset(pstore, 0, sizeof(SEG_STORE));
+	return true;
+}
+
+void segstore_free(P_SEG_STORE pstore)
+{
+	free(pstore->end_x);
+	free(pstore->end_y);
+	free(pstore->step_x);
+	free(pstore->step_y);
+	free(pstore->length);
+	free(pstore->owner);
+	memset(pstore, 0, sizeof(SEG_STORE));
+}
+
+static bool segstore_grow(P_SEG_STORE pstore)
+{
+	int newcap = pstore->capacity ? pstore->capacity * 2 : 4 * SEGSTORE_LANES;
+	short **arrays[] = { &pstore->end_x, &pstore->end_y, &pstore->step_x,
+			     &pstore->step_y, &pstore->length };
+	void *p = NULL;
+	int i;
+
+	for(i = 0; i < sizeof(arrays) / sizeof(arrays[0]); i++) {
+		p = realloc(*arrays[i], newcap * sizeof(short));
+		if( ! p) {
+			return false;
+		}
+		*arrays[i] = p;
+		memset(*arrays[i] + pstore->capacity, 0,
+		       (newcap - pstore->capacity) * sizeof(short));
+	}
+
+	p = realloc(pstore->owner, newcap * sizeof(P_SSEG));
+	if( ! p) {
+		return false;
+	}
+	pstore->owner = p;
+	pstore->capacity = newcap;
+	return true;
+}
+
+bool segstore_add(P_SEG_STORE pstore, P_SSEG pseg)
+{
+	if(pstore->count == pstore->capacity && ! segstore_grow(pstore)) {
+		return false;
+	}
+
+	pseg->slot = pstore->count++;
+	pstore->owner[pseg->slot] = pseg;
+	segstore_sync(pstore, pseg);
+	return true;
+}
+
+/* Keep slots dense by moving the last segment into the vacated slot */
+void segstore_remove(P_SEG_STORE pstore, P_SSEG pseg)
+{
+	int slot = pseg->slot;
+	int last = --pstore->count;
+
+	if(slot != last) {
+		pstore->end_x[slot] = pstore->end_x[last];
+		pstore->end_y[slot] = pstore->end_y[last];
+		pstore->step_x[slot] = pstore->step_x[last];
+		pstore->step_y[slot] = pstore->step_y[last];
+		pstore->length[slot] = pstore->length[last];
+		pstore->owner[slot] = pstore->owner[last];
+		pstore->owner[slot]->slot = slot;
+	}
+
+	pstore->length[last] = 0;
+	pseg->slot = -1;
+}
+
+void segstore_sync(P_SEG_STORE pstore, P_SSEG pseg)
+{
+	COORD step = {0, 0};
+	int slot = pseg->slot;
+
+	seg_update_coord(pseg->dir, &step);
+	pstore->end_x[slot] = pseg->coord_end.x;
+	pstore->end_y[slot] = pseg->coord_end.y;
+	pstore->step_x[slot] = step.x;
+	pstore->step_y[slot] = step.y;
+	pstore->length[slot] = pseg->length;
+}
+
+/* A point (x,y) lies on a run when, with dx = x - end_x, dy = y - end_y,
+   some t in [0, length) satisfies dx == t*step_x and dy == t*step_y.
+   Since the steps are -1, 0 or 1, t can only be max(dx*step_x, dy*step_y),
+   which covers horizontal, vertical and diagonal runs alike.
+*/
+int segstore_hit_scalar(P_SEG_STORE pstore, int from, P_COORD pc, int skip_slot)
+{
+	int i, dx, dy, t, a, b;
+
+	for(i = from; i < pstore->count; i++) {
+		dx = pc->x - pstore->end_x[i];
+		dy = pc->y - pstore->end_y[i];
+		a = dx * pstore->step_x[i];
+		b = dy * pstore->step_y[i];
+		t = a > b ? a : b;
+		if(t >= 0 && t < pstore->length[i] &&
+		   dx == t * pstore->step_x[i] &&
+		   dy == t * pstore->step_y[i] &&
+		   i != skip_slot) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/* Return the slot of a segment covering pc (ignoring skip_slot), or -1 */
+int segstore_hit(P_SEG_STORE pstore, P_COORD pc, int skip_slot)
+{
+#ifdef __SSE2__
+	const __m128i px = _mm_set1_epi16(pc->x);
+	const __m128i py = _mm_set1_epi16(pc->y);
+	const __m128i minus1 = _mm_set1_epi16(-1);
+	__m128i dx, dy, sx, sy, t, hit;
+	int i, lane;
+	unsigned mask;
+
+	/* Capacity is a whole number of vectors and padding never hits */
+	for(i = 0; i < pstore->count; i += SEGSTORE_LANES) {
+		sx = _mm_loadu_si128((const __m128i *)&pstore->step_x[i]);
+		sy = _mm_loadu_si128((const __m128i *)&pstore->step_y[i]);
+		dx = _mm_sub_epi16(px, _mm_loadu_si128((const __m128i *)&pstore->end_x[i]));
+		dy = _mm_sub_epi16(py, _mm_loadu_si128((const __m128i *)&pstore->end_y[i]));
+		t = _mm_max_epi16(_mm_mullo_epi16(dx, sx), _mm_mullo_epi16(dy, sy));
+
+		hit = _mm_and_si128(_mm_cmpgt_epi16(t, minus1),
+		      _mm_cmplt_epi16(t, _mm_loadu_si128((const __m128i *)&pstore->length[i])));
+		hit = _mm_and_si128(hit, _mm_cmpeq_epi16(dx, _mm_mullo_epi16(t, sx)));
+		hit = _mm_and_si128(hit, _mm_cmpeq_epi16(dy, _mm_mullo_epi16(t, sy)));
+
+		mask = _mm_movemask_epi8(hit);
+		while(mask) {
+			lane = __builtin_ctz(mask) / 2;
+			if(i + lane != skip_slot) {
+				return i + lane;
+			}
+			mask &= ~(3u << (lane * 2));
+		}
+	}
+
+	return -1;
+#else
+	return segstore_hit_scalar(pstore, 0, pc, skip_slot);
+#endif
+}
+
+/* Play a scripted game through the current renderer into 'out' */
+static bool bench_render_one(FILE *out, int frames, double *pcpu, long long *pbytes)
+{
+	static const direction_t turns[] = { DIR_LEFT, DIR_UP_LEFT, DIR_UP,
+					     DIR_UP_RIGHT, DIR_RIGHT, DIR_UP };
+	WINDOW_SNAKE ws;
+	SETTINGS settings;
+	P_SNAKE psnake = NULL;
+	FOOD food;
+	struct timespec t0, t1;
+	struct stat st;
+	int i;
+
+	init_settings(&settings);
+	settings.cheat = true;
+
+	if( ! renderer->init(&ws, out) || ! level_init(&ws)) {
+		return false;
+	}
+	psnake = snake_init(&ws);
+	if( ! psnake) {
+		return false;
+	}
+	snake_draw_init(&ws, &settings, psnake);
+	DRAW_REFRESH();
+	fstat(fileno(out), &st);
+	*pbytes = -st.st_size;
+
+	food.b_eaten = true;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t0);
+	for(i = 0; i < frames; i++) {
+		if(i % 7 == 0) {
+			snake_steer(&ws, &settings, psnake, turns[(i / 7) % 6]);
+			settings.b_altered = true;
+		}
+		if(settings.b_altered) {
+			show_status(&ws, &settings, psnake);
+		}
+		if(food.b_eaten) {
+			place_food(&ws, &settings, &food, psnake);
+		}
+		snake_move(&ws, &settings, psnake, &food);
+		DRAW_REFRESH();
+	}
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t1);
+
+	fflush(out);
+	fstat(fileno(out), &st);
+	*pbytes += st.st_size;
+	*pcpu = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	renderer->uninit();
+	free_snake(psnake);
+	level_free(&ws);
+	return true;
+}
+
+/* Compare renderers by bytes written and CPU time per frame, rendering
+   into a temporary file on an 80x24 screen
+*/
+int bench_render(int frames)
+{
+	P_RENDERER all[] = { &renderer_ncurses, &renderer_ansi };
+	FILE *out = NULL;
+	long long bytes;
+	double cpu;
+	int i;
+
+	setenv("LINES", "24", 0);
+	setenv("COLUMNS", "80", 0);
+	if( ! getenv("TERM")) {
+		setenv("TERM", "xterm", 1);
+	}
+
+	printf("render: %d frames, %sx%s\n", frames, getenv("COLUMNS"), getenv("LINES"));
+	for(i = 0; i < sizeof(all) / sizeof(all[0]); i++) {
+		out = tmpfile();
+		if( ! out) {
+			return 1;
+		}
+		renderer = all[i];
+		if( ! bench_render_one(out, frames, &cpu, &bytes)) {
+			fprintf(stderr, "nsnake: %s renderer failed\n", renderer->name);
+			return 1;
+		}
+		printf("  %-8s %8.1f bytes/frame  %8.2f us cpu/frame\n",
+		       renderer->name, (double)bytes / frames, cpu * 1e6 / frames);
+		fclose(out);
+	}
+
+	return 0;
+}
+
+/* Batched headless games
+ *************************/
+
+#define DIR_CODE(dir)	(((dir) - DIR_LEFT) >> 1)
+#define CODE_DIR(code)	((direction_t)(DIR_LEFT + ((code) << 1)))
+
+/* Batch boards sit at (1, 1) like an ncurses board inside its box. A
+   build with -DBOARD_WIDTH=W -DBOARD_HEIGHT=H (make nsnake-16x16) bakes
+   the board size in, so cell indexing, border tests, portal wrap and
+   the body ring arithmetic below work on constants; with power-of-two
+   sizes they come down to shifts and masks. Interactive games still
+   size the board from the terminal.
+*/
+#define BATCH_BEG	1
+#if defined(BOARD_WIDTH) && defined(BOARD_HEIGHT)
+#define BATCH_WIDTH(penv)	BOARD_WIDTH
+#define BATCH_HEIGHT(penv)	BOARD_HEIGHT
+#else
+#define BATCH_WIDTH(penv)	((penv)->ws.plevel->width)
+#define BATCH_HEIGHT(penv)	((penv)->ws.plevel->height)
+#endif
+#define BATCH_CELLS(penv)	(BATCH_WIDTH(penv) * BATCH_HEIGHT(penv))
+
+/* Row-major index of an on-board coordinate, board_index() for batches */
+static inline int batch_index(P_BATCH_ENV penv, P_COORD pc)
+{
+	return (pc->y - BATCH_BEG) * BATCH_WIDTH(penv) + (pc->x - BATCH_BEG);
+}
+
+/* Body ring slot i, for any i in [0, 2 * cells) */
+static inline int batch_ring(P_BATCH_ENV penv, int i)
+{
+	return (unsigned int)i % (unsigned int)BATCH_CELLS(penv);
+}
+
+static inline bool batch_is_border(P_BATCH_ENV penv, P_COORD pc)
+{
+	return (unsigned int)(pc->x - BATCH_BEG) >= (unsigned int)BATCH_WIDTH(penv) ||
+	       (unsigned int)(pc->y - BATCH_BEG) >= (unsigned int)BATCH_HEIGHT(penv);
+}
+
+/* portal_coord() with the straight moves inlined; diagonals are rare */
+static inline void batch_portal_coord(P_BATCH_ENV penv, direction_t dir,
+				      P_COORD phead, P_COORD pc)
+{
+	switch(dir) {
+		case DIR_UP:
+			pc->x = phead->x;
+			pc->y = BATCH_BEG + BATCH_HEIGHT(penv) - 1;
+			break;
+		case DIR_DOWN:
+			pc->x = phead->x;
+			pc->y = BATCH_BEG;
+			break;
+		case DIR_LEFT:
+			pc->y = phead->y;
+			pc->x = BATCH_BEG + BATCH_WIDTH(penv) - 1;
+			break;
+		case DIR_RIGHT:
+			pc->y = phead->y;
+			pc->x = BATCH_BEG;
+			break;
+		default:
+			portal_coord(&penv->ws, dir, phead, pc);
+			break;
+	}
+}
+
+static inline unsigned int batch_rand(P_BATCH_ENV penv, int g)
+{
+	unsigned int x = penv->rng[g];
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	penv->rng[g] = x;
+	return x;
+}
+
+P_BATCH_ENV batch_create(int n_games, int width, int height,
+			 P_SETTINGS pset, const char *level_path)
+{
+	P_BATCH_ENV penv = NULL;
+	size_t n = n_games, cells;
+	int g;
+
+	penv = calloc(sizeof(BATCH_ENV), 1);
+	if( ! penv) {
+		return NULL;
+	}
+
+#ifdef BOARD_WIDTH
+	if(width != BOARD_WIDTH || height != BOARD_HEIGHT) {
+		free(penv);
+		return NULL;
+	}
+#endif
+
+	/* Same geometry as an ncurses board inside its box */
+	penv->ws._begx = BATCH_BEG;
+	penv->ws._begy = BATCH_BEG;
+	penv->ws._maxx = BATCH_BEG + width - 1;
+	penv->ws._maxy = BATCH_BEG + height - 1;
+	if( ! level_init(&penv->ws)) {
+		free(penv);
+		return NULL;
+	}
+	if(level_path && ! level_load(&penv->ws, level_path)) {
+		batch_free(penv);
+		return NULL;
+	}
+
+	cells = (size_t)width * height;
+	penv->n_games = n_games;
+	penv->cells = cells;
+	penv->settings = *pset;
+
+	penv->head = calloc(n, sizeof(int));
+	penv->length = calloc(n, sizeof(int));
+	penv->score = calloc(n, sizeof(int));
+	penv->ticks = calloc(n, sizeof(int));
+	penv->dir = calloc(n, sizeof(direction_t));
+	penv->rng = calloc(n, sizeof(unsigned int));
+	penv->body = calloc(n * cells, sizeof(COORD));
+	penv->body_dir = calloc(n * cells, 1);
+	penv->occupied = calloc(n * cells, 1);
+	penv->visits = calloc(cells, sizeof(unsigned int));
+	penv->head_x = calloc(n, sizeof(short));
+	penv->head_y = calloc(n, sizeof(short));
+	penv->food_x = calloc(n, sizeof(short));
+	penv->food_y = calloc(n, sizeof(short));
+	penv->reward = calloc(n, sizeof(float));
+	penv->done = calloc(n, 1);
+	penv->final_score = calloc(n, sizeof(int));
+	penv->zob = calloc(n, sizeof(ZOBRIST));
+	reach_init(&penv->reach, cells);
+	if( ! penv->head || ! penv->length || ! penv->score || ! penv->ticks ||
+	    ! penv->dir || ! penv->rng || ! penv->body || ! penv->body_dir ||
+	    ! penv->occupied || ! penv->visits || ! penv->head_x || ! penv->head_y ||
+	    ! penv->food_x || ! penv->food_y || ! penv->reward ||
+	    ! penv->done || ! penv->final_score || ! penv->zob ||
+	    ! penv->reach.mark) {
+		batch_free(penv);
+		return NULL;
+	}
+
+	for(g = 0; g < n_games; g++) {
+		penv->rng[g] = 2463534242u ^ (g * 2654435761u);
+		if( ! penv->rng[g]) {
+			penv->rng[g] = 1;
+		}
+		batch_reset(penv, g);
+	}
+
+	return penv;
+}
+
+void batch_free(P_BATCH_ENV penv)
+{
+	if( ! penv) {
+		return;
+	}
+	free(penv->head);
+	free(penv->length);
+	free(penv->score);
+	free(penv->ticks);
+	free(penv->dir);
+	free(penv->rng);
+	free(penv->body);
+	free(penv->body_dir);
+	free(penv->occupied);
+	free(penv->visits);
+	free(penv->head_x);
+	free(penv->head_y);
+	free(penv->food_x);
+	free(penv->food_y);
+	free(penv->reward);
+	free(penv->done);
+	free(penv->final_score);
+	free(penv->zob);
+	reach_free(&penv->reach);
+	level_free(&penv->ws);
+	free(penv);
+}
+
+/* Same acceptance rule and coordinate ranges as place_food(). Falls back
+   to a linear scan when the board is nearly full; returns false if there
+   is no free cell at all.
+*/
+static bool batch_place_food(P_BATCH_ENV penv, int g)
+{
+	const unsigned char *cells = penv->ws.plevel->cells;
+	unsigned char *occ = &penv->occupied[(size_t)g * BATCH_CELLS(penv)];
+	COORD c;
+	int tries, i;
+
+	/* Board right/bottom edges are width/height, as _maxx/_maxy */
+	for(tries = 0; tries < FOOD_TRIES; tries++) {
+		c.y = batch_rand(penv, g) % (unsigned int)BATCH_HEIGHT(penv);
+		c.x = batch_rand(penv, g) % (unsigned int)BATCH_WIDTH(penv);
+		if(c.x < BATCH_BEG || c.y < BATCH_BEG ||
+		   cells[batch_index(penv, &c)] != CELL_FREE ||
+		   occ[batch_index(penv, &c)]) {
+			continue;
+		}
+		penv->food_x[g] = c.x;
+		penv->food_y[g] = c.y;
+		zobrist_food(&penv->zob[g], &c);
+		return true;
+	}
+
+	for(i = 0; i < BATCH_CELLS(penv); i++) {
+		c.x = BATCH_BEG + i % BATCH_WIDTH(penv);
+		c.y = BATCH_BEG + i / BATCH_WIDTH(penv);
+		if(c.x < BATCH_WIDTH(penv) && c.y < BATCH_HEIGHT(penv) &&
+		   cells[i] == CELL_FREE && ! occ[i]) {
+			penv->food_x[g] = c.x;
+			penv->food_y[g] = c.y;
+			zobrist_food(&penv->zob[g], &c);
+			return true;
+		}
+	}
+
+	zobrist_food(&penv->zob[g], NULL);
+	return false;
+}
+
+/* Lay out the initial snake the way snake_init() does: a vertical run
+   along the right edge, heading up.
+*/
+void batch_reset(P_BATCH_ENV penv, int g)
+{
+	WINDOW_SNAKE *ws = &penv->ws;
+	size_t base = (size_t)g * BATCH_CELLS(penv);
+	int len = DEFAULT_INIT_LENGTH;
+	int i;
+
+	if(len > BATCH_HEIGHT(penv)) {
+		len = BATCH_HEIGHT(penv);
+	}
+
+	memset(&penv->occupied[base], 0, BATCH_CELLS(penv));
+	memset(&penv->zob[g], 0, sizeof(ZOBRIST));
+	zobrist_settings(&penv->zob[g], &penv->settings);
+	for(i = 0; i < len; i++) {
+		/* Ring runs tail (index 0) to head (index len-1) */
+		penv->body[base + i].x = ws->_maxx;
+		penv->body[base + i].y = ws->_maxy - i;
+		penv->body_dir[base + i] = DIR_CODE(DIR_UP);
+		penv->occupied[base + batch_index(penv, &penv->body[base + i])]++;
+		penv->visits[batch_index(penv, &penv->body[base + i])]++;
+		zobrist_toggle(&penv->zob[g], &penv->body[base + i]);
+	}
+
+	penv->head[g] = len - 1;
+	penv->length[g] = len;
+	penv->score[g] = 0;
+	penv->ticks[g] = 0;
+	penv->dir[g] = DIR_UP;
+	penv->head_x[g] = ws->_maxx;
+	penv->head_y[g] = ws->_maxy - len + 1;
+	zobrist_head(&penv->zob[g], &penv->body[base + len - 1], DIR_UP);
+	batch_place_food(penv, g);
+}
+
+/* Reverse body order and flip each cell's direction, as reverse_snake()
+   does for segments
+*/
+static void batch_reverse(P_BATCH_ENV penv, int g)
+{
+	size_t base = (size_t)g * BATCH_CELLS(penv);
+	int cap = BATCH_CELLS(penv);
+	int i = penv->head[g];
+	int j = batch_ring(penv, penv->head[g] - penv->length[g] + 1 + cap);
+	int n;
+	COORD c;
+	unsigned char d;
+
+	for(n = penv->length[g] / 2; n > 0; n--) {
+		c = penv->body[base + i];
+		penv->body[base + i] = penv->body[base + j];
+		penv->body[base + j] = c;
+		d = penv->body_dir[base + i];
+		penv->body_dir[base + i] = penv->body_dir[base + j];
+		penv->body_dir[base + j] = d;
+		i = batch_ring(penv, i - 1 + cap);
+		j = batch_ring(penv, j + 1);
+	}
+
+	for(n = 0, i = penv->head[g]; n < penv->length[g]; n++) {
+		penv->body_dir[base + i] = DIR_CODE(get_oppose_dir(CODE_DIR(penv->body_dir[base + i])));
+		i = batch_ring(penv, i - 1 + cap);
+	}
+
+	i = penv->head[g];
+	penv->dir[g] = CODE_DIR(penv->body_dir[base + i]);
+	penv->head_x[g] = penv->body[base + i].x;
+	penv->head_y[g] = penv->body[base + i].y;
+	zobrist_head(&penv->zob[g], &penv->body[base + i], penv->dir[g]);
+}
+
+/* Advance one game by one tick. Mirrors snake_steer() followed by
+   snake_move(): border/portal handling, level obstacles and portals,
+   self collision unless cheating, then eat or advance the tail.
+   Returns TERM_NONE while the game goes on, else why it ended.
+*/
+static term_cause_t batch_step_one(P_BATCH_ENV penv, int g, direction_t action)
+{
+	WINDOW_SNAKE *ws = &penv->ws;
+	P_SETTINGS pset = &penv->settings;
+	size_t base = (size_t)g * BATCH_CELLS(penv);
+	unsigned char *occ = &penv->occupied[base];
+	int cap = BATCH_CELLS(penv);
+	COORD head, next;
+	unsigned char cell;
+	int i, tail;
+
+	/* Steer */
+	if(action && action != penv->dir[g]) {
+		if(action == get_oppose_dir(penv->dir[g])) {
+			if(pset->reverse) {
+				batch_reverse(penv, g);
+			}
+		}
+		else {
+			penv->dir[g] = action;
+			zobrist_head(&penv->zob[g], &penv->body[base + penv->head[g]], action);
+		}
+	}
+
+	/* Move the head */
+	head = penv->body[base + penv->head[g]];
+	next = head;
+	seg_update_coord(penv->dir[g], &next);
+	if(batch_is_border(penv, &next)) {
+		if( ! pset->portal) {
+			return TERM_WALL;
+		}
+		batch_portal_coord(penv, penv->dir[g], &head, &next);
+	}
+
+	i = batch_index(penv, &next);
+	cell = ws->plevel->cells[i];
+	if(cell == CELL_WALL) {
+		return TERM_OBSTACLE;
+	}
+	if(cell >= CELL_PORTAL) {
+		level_portal_exit(ws, cell, &next);
+		i = batch_index(penv, &next);
+	}
+
+	if( ! pset->cheat && occ[i]) {
+		return TERM_SELF;
+	}
+
+	/* A full ring means the board is full, nothing left to win */
+	if(penv->length[g] == cap) {
+		return TERM_BOARD_FULL;
+	}
+
+	penv->head[g] = batch_ring(penv, penv->head[g] + 1);
+	penv->body[base + penv->head[g]] = next;
+	penv->body_dir[base + penv->head[g]] = DIR_CODE(penv->dir[g]);
+	occ[i]++;
+	penv->visits[i]++;
+	penv->length[g]++;
+	penv->head_x[g] = next.x;
+	penv->head_y[g] = next.y;
+	zobrist_toggle(&penv->zob[g], &next);
+	zobrist_head(&penv->zob[g], &next, penv->dir[g]);
+
+	/* Eat, or advance the tail */
+	if(next.x == penv->food_x[g] && next.y == penv->food_y[g]) {
+		penv->score[g]++;
+		penv->reward[g] = 1.0f;
+		return batch_place_food(penv, g) ? TERM_NONE : TERM_BOARD_FULL;
+	}
+
+	tail = batch_ring(penv, penv->head[g] - penv->length[g] + 1 + cap);
+	occ[batch_index(penv, &penv->body[base + tail])]--;
+	zobrist_toggle(&penv->zob[g], &penv->body[base + tail]);
+	penv->length[g]--;
+
+	return TERM_NONE;
+}
+
+/* Free cells game g can reach after moving in dir, counted up to the
+   snake's length; see snake_reach_dir()
+*/
+int batch_reach_dir(P_BATCH_ENV penv, int g, direction_t dir)
+{
+	WINDOW_SNAKE *ws = &penv->ws;
+	P_SETTINGS pset = &penv->settings;
+	size_t base = (size_t)g * penv->cells;
+	int cap = penv->cells;
+	int from = penv->head[g];
+	COORD next;
+
+	if(dir == get_oppose_dir(penv->dir[g])) {
+		if(pset->reverse) {
+			/* The tail becomes the head and heads away from the body */
+			from = batch_ring(penv, penv->head[g] - penv->length[g] + 1 + cap);
+			dir = get_oppose_dir(CODE_DIR(penv->body_dir[base + from]));
+		}
+		else {
+			dir = penv->dir[g];
+		}
+	}
+
+	if( ! reach_next(ws, pset, &penv->body[base + from], dir, &next)) {
+		return 0;
+	}
+	return reach_count(ws, pset, &penv->reach,
+			   pset->cheat ? NULL : &penv->occupied[base],
+			   &next, penv->length[g]);
+}
+
+/* Submit a finished game to the telemetry log and the high-score
+   store. Segments are counted as
+   runs of body cells sharing a direction, which is what the segment list
+   of an interactive game would hold.
+*/
+static void batch_log_game(P_BATCH_ENV penv, int g, term_cause_t cause)
+{
+	size_t base = (size_t)g * penv->cells;
+	int cap = penv->cells;
+	int i, n, prev = -1;
+	GAME_RECORD rec;
+
+	memset(&rec, 0, sizeof(rec));
+	for(n = 0, i = penv->head[g]; n < penv->length[g]; n++) {
+		if(penv->body_dir[base + i] != prev) {
+			rec.seg_count++;
+			prev = penv->body_dir[base + i];
+		}
+		i = batch_ring(penv, i - 1 + cap);
+	}
+
+	rec.time = time(NULL);
+	rec.batch = true;
+	rec.score = penv->score[g];
+	rec.length = penv->length[g];
+	rec.ticks = penv->ticks[g];
+	rec.cause = cause;
+	rec.hash = penv->zob[g].hash;
+	rec.portal = penv->settings.portal;
+	rec.reverse = penv->settings.reverse;
+	rec.cheat = penv->settings.cheat;
+	rec.speed = penv->settings.speed;
+	rec.board_width = penv->ws.plevel->width;
+	rec.board_height = penv->ws.plevel->height;
+	telemetry_submit(&rec);
+	scores_submit(&rec);
+}
+
+/* Step every game once. actions[g] is a direction_t, or 0 to keep the
+   current heading; actions may be NULL. Finished games are flagged in
+   done[], rewarded -1 and reset in place.
+*/
+void batch_step(P_BATCH_ENV penv, const direction_t *actions)
+{
+	bool log = telemetry_enabled() || scores_enabled();
+	term_cause_t cause;
+	int g;
+
+	for(g = 0; g < penv->n_games; g++) {
+		penv->reward[g] = 0.0f;
+		penv->done[g] = 0;
+		penv->ticks[g]++;
+		cause = batch_step_one(penv, g, actions ? actions[g] : 0);
+		if(cause != TERM_NONE) {
+			penv->reward[g] = -1.0f;
+			penv->done[g] = 1;
+			penv->final_score[g] = penv->score[g];
+			penv->games_finished++;
+			if(log) {
+				batch_log_game(penv, g, cause);
+			}
+			batch_reset(penv, g);
+		}
+	}
+
+	penv->steps += penv->n_games;
+}
+
+/* Drive a batch with a random policy and report throughput */
+int run_batch(P_OPTIONS popt)
+{
+	P_BATCH_ENV penv = NULL;
+	SETTINGS settings;
+	direction_t *actions = NULL;
+	P_BOT_SEAT seats = NULL;
+	int steps = popt->batch_steps ? popt->batch_steps : 1000;
+#ifdef BOARD_WIDTH
+	int width = popt->board_width ? popt->board_width : BOARD_WIDTH;
+	int height = popt->board_height ? popt->board_height : BOARD_HEIGHT;
+#else
+	int width = popt->board_width ? popt->board_width : 16;
+	int height = popt->board_height ? popt->board_height : 16;
+#endif
+	long long total_score = 0;
+	unsigned int r = 1;
+	double t0, elapsed;
+	int i, g;
+
+#ifdef BOARD_WIDTH
+	if(width != BOARD_WIDTH || height != BOARD_HEIGHT) {
+		fprintf(stderr, "nsnake: this build only plays %dx%d boards\n",
+			BOARD_WIDTH, BOARD_HEIGHT);
+		return 1;
+	}
+#endif
+	init_settings(&settings);
+	penv = batch_create(popt->batch_games, width, height, &settings,
+			    popt->level_path);
+	actions = calloc(popt->batch_games, sizeof(direction_t));
+	if(bot_loaded()) {
+		seats = calloc(popt->batch_games, sizeof(BOT_SEAT));
+	}
+	if( ! penv || ! actions || (bot_loaded() && ! seats)) {
+		fprintf(stderr, "nsnake: could not create batch\n");
+		batch_free(penv);
+		free(actions);
+		free(seats);
+		return 1;
+	}
+	for(g = 0; seats && g < penv->n_games; g++) {
+		bot_seat_batch(&seats[g], penv, g);
+	}
+
+	t0 = bench_now();
+	for(i = 0; i < steps; i++) {
+		for(g = 0; g < penv->n_games; g++) {
+			if(seats) {
+				actions[g] = bot_decide(&seats[g]);
+				continue;
+			}
+			r = r * 1103515245u + 12345u;
+			actions[g] = ((r >> 16) & 7) ? 0 : CODE_DIR((r >> 20) & 7);
+		}
+		batch_step(penv, actions);
+		for(g = 0; g < penv->n_games; g++) {
+			if(penv->done[g]) {
+				total_score += penv->final_score[g];
+				if(seats) {
+					/* A fresh game gets a fresh bot */
+					bot_seat_free(&seats[g]);
+					bot_seat_batch(&seats[g], penv, g);
+				}
+			}
+		}
+	}
+	elapsed = bench_now() - t0;
+
+	printf("batch: %d games on %dx%d, %d steps\n",
+	       penv->n_games, width, height, steps);
+	printf("  %.0f game-steps/s, %lld games finished, avg score %.2f\n",
+	       penv->steps / elapsed, penv->games_finished,
+	       penv->games_finished ? (double)total_score / penv->games_finished : 0.0);
+	heatmap_write(penv->visits, width, height);
+
+	for(g = 0; seats && g < penv->n_games; g++) {
+		bot_seat_free(&seats[g]);
+	}
+	free(seats);
+	batch_free(penv);
+	free(actions);
+	return 0;
+}
+
+/* Benchmarks
+ *************/
+
+double bench_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int run_bench(P_OPTIONS popt)
+{
+	if( ! strcmp(popt->bench, "segments")) {
+		return bench_segments(popt->bench_size ? popt->bench_size : 10000);
+	}
+	if( ! strcmp(popt->bench, "render")) {
+		return bench_render(popt->bench_size ? popt->bench_size : 5000);
+	}
+	if( ! strcmp(popt->bench, "timers")) {
+		return bench_timers(popt->bench_size ? popt->bench_size : 10000);
+	}
+
+	fprintf(stderr, "nsnake: unknown benchmark '%s'\n", popt->bench);
+	return 1;
+}
+
+/* Build a staircase snake of nseg segments and time point queries
+   through the original list walk against the segment store.
+*/
+int bench_segments(int nseg)
+{
+	const int queries = 2000;
+	const int seg_len = 3;
+	P_SNAKE psnake = NULL;
+	P_SSEG pseg = NULL;
+	COORD at = {0, 0};
+	COORD *points = NULL;
+	double t0, t_list, t_store, t_scalar;
+	int i, hits_list = 0, hits_store = 0, hits_scalar = 0;
+
+	/* Coordinates are shorts, keep the staircase inside their range */
+	if(nseg < 1 || nseg > 20000) {
+		fprintf(stderr, "nsnake: segment bench supports 1..20000 segments\n");
+		return 1;
+	}
+
+	psnake = calloc(sizeof(SNAKE), 1);
+	points = calloc(sizeof(COORD), queries);
+	if( ! psnake || ! points || ! segstore_init(&psnake->segs)) {
+		return 1;
+	}
+
+	/* Walk right and up alternately, appending segments at the tail */
+	for(i = 0; i < nseg; i++) {
+		pseg = calloc(sizeof(SSEG), 1);
+		if( ! pseg) {
+			return 1;
+		}
+		pseg->dir = (i & 1) ? DIR_UP : DIR_RIGHT;
+		pseg->length = seg_len;
+		pseg->coord_end = at;
+		pseg->coord_start = at;
+		seg_update_coord(pseg->dir, &pseg->coord_start);
+		seg_update_coord(pseg->dir, &pseg->coord_start);
+		at = pseg->coord_start;
+		seg_update_coord(pseg->dir, &at);
+
+		pseg->next = psnake->seg_head;
+		if(psnake->seg_head) {
+			psnake->seg_head->previous = pseg;
+		} else {
+			psnake->seg_tail = pseg;
+		}
+		psnake->seg_head = pseg;
+		psnake->seg_count++;
+		if( ! segstore_add(&psnake->segs, pseg)) {
+			return 1;
+		}
+	}
+
+	/* Mix of points on and next to the body */
+	srandom(1);
+	for(i = 0; i < queries; i++) {
+		pseg = psnake->segs.owner[random() % nseg];
+		points[i] = pseg->coord_end;
+		points[i].x += random() % 3 - 1;
+		points[i].y += random() % 3 - 1;
+	}
+
+	t0 = bench_now();
+	for(i = 0; i < queries; i++) {
+		hits_list += is_coord_on_snake_list(&points[i], psnake);
+	}
+	t_list = bench_now() - t0;
+
+	t0 = bench_now();
+	for(i = 0; i < queries; i++) {
+		hits_scalar += segstore_hit_scalar(&psnake->segs, 0, &points[i], -1) >= 0;
+	}
+	t_scalar = bench_now() - t0;
+
+	t0 = bench_now();
+	for(i = 0; i < queries; i++) {
+		hits_store += is_coord_on_snake(&points[i], psnake);
+	}
+	t_store = bench_now() - t0;
+
+	printf("segments: %d, queries: %d\n", nseg, queries);
+	printf("  list walk      %10.1f ns/query  (%d hits)\n", t_list * 1e9 / queries, hits_list);
+	printf("  store scalar   %10.1f ns/query  (%d hits)\n", t_scalar * 1e9 / queries, hits_scalar);
+	printf("  store simd     %10.1f ns/query  (%d hits)\n", t_store * 1e9 / queries, hits_store);
+
+	free(points);
+	free_snake(psnake);
+	return (hits_list == hits_store && hits_store == hits_scalar) ? 0 : 1;
+}
+
+/* Keep n_timers pending, each re-arming with a pseudo-random delay when
+   it fires, and time the wheel against scanning every timer each tick.
+*/
+static P_TIMER_WHEEL bench_wheel;
+static unsigned int bench_timer_fired;
+
+static unsigned int bench_timer_delay(unsigned int *pstate)
+{
+	*pstate = *pstate * 1103515245u + 12345u;
+	return 1 + (*pstate >> 8) % 100000;
+}
+
+static void bench_timer_fn(P_TIMER pt)
+{
+	bench_timer_fired++;
+	timer_add(bench_wheel, pt, bench_timer_delay(pt->arg));
+}
+
+int bench_timers(int n_timers)
+{
+	const int ticks = 200000;
+	P_TIMER_WHEEL tw = NULL;
+	P_TIMER timers = NULL;
+	unsigned int *state_wheel = NULL, *state_scan = NULL;
+	unsigned long long *expires = NULL;
+	unsigned int fired_scan = 0;
+	double t0, t_add, t_wheel, t_scan, t_cancel;
+	int i, t;
+
+	tw = malloc(sizeof(TIMER_WHEEL));
+	timers = calloc(n_timers, sizeof(TIMER));
+	state_wheel = calloc(n_timers, sizeof(unsigned int));
+	state_scan = calloc(n_timers, sizeof(unsigned int));
+	expires = calloc(n_timers, sizeof(unsigned long long));
+	if( ! tw || ! timers || ! state_wheel || ! state_scan || ! expires) {
+		return 1;
+	}
+
+	timer_wheel_init(tw);
+	bench_wheel = tw;
+	bench_timer_fired = 0;
+	for(i = 0; i < n_timers; i++) {
+		state_wheel[i] = state_scan[i] = i;
+		timer_init(&timers[i], bench_timer_fn, &state_wheel[i]);
+		expires[i] = bench_timer_delay(&state_scan[i]);
+	}
+
+	t0 = bench_now();
+	for(i = 0; i < n_timers; i++) {
+		timer_add(tw, &timers[i], bench_timer_delay(&state_wheel[i]));
+	}
+	t_add = bench_now() - t0;
+
+	t0 = bench_now();
+	for(t = 1; t <= ticks; t++) {
+		timer_wheel_tick(tw);
+	}
+	t_wheel = bench_now() - t0;
+
+	t0 = bench_now();
+	for(t = 1; t <= ticks; t++) {
+		for(i = 0; i < n_timers; i++) {
+			if(expires[i] == t) {
+				fired_scan++;
+				expires[i] = t + bench_timer_delay(&state_scan[i]);
+			}
+		}
+	}
+	t_scan = bench_now() - t0;
+
+	t0 = bench_now();
+	for(i = 0; i < n_timers; i++) {
+		timer_cancel(&timers[i]);
+	}
+	t_cancel = bench_now() - t0;
+
+	printf("timers: %d pending, %d ticks\n", n_timers, ticks);
+	printf("  wheel add      %10.1f ns/timer\n", t_add * 1e9 / n_timers);
+	printf("  wheel tick     %10.1f ns/tick   (%u fired)\n", t_wheel * 1e9 / ticks, bench_timer_fired);
+	printf("  scan tick      %10.1f ns/tick   (%u fired)\n", t_scan * 1e9 / ticks, fired_scan);
+	printf("  wheel cancel   %10.1f ns/timer\n", t_cancel * 1e9 / n_timers);
+
+	free(expires);
+	free(state_scan);
+	free(state_wheel);
+	free(timers);
+	free(tw);
+	return bench_timer_fired == fired_scan ? 0 : 1;
+}
+
+/* Row-major index of an on-board coordinate into per-cell maps */
+static inline int board_index(WINDOW_SNAKE *ws, P_COORD pc)
+{
+	return (pc->y - ws->_begy) * ws->plevel->width + (pc->x - ws->_begx);
+}
+
+/* Zobrist hash
+ ***************/
+
+/* splitmix64 finaliser over the packed (kind, x, y); no key table, so
+   every board size and every process gets the same keys
+*/
+static inline uint64_t zobrist_key(int kind, int x, int y)
+{
+	uint64_t z = ((uint64_t)kind << 48) ^ ((uint64_t)(uint16_t)y << 24) ^ (uint16_t)x;
+
+	z += 0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/* Add or remove one body cell */
+static inline void zobrist_toggle(P_ZOBRIST pz, P_COORD pc)
+{
+	pz->hash ^= zobrist_key(ZOBRIST_BODY, pc->x, pc->y);
+}
+
+static inline void zobrist_set(P_ZOBRIST pz, uint64_t *pslot, uint64_t key)
+{
+	pz->hash ^= *pslot ^ key;
+	*pslot = key;
+}
+
+void zobrist_head(P_ZOBRIST pz, P_COORD pc, direction_t dir)
+{
+	zobrist_set(pz, &pz->k_head, zobrist_key(ZOBRIST_HEAD, pc->x, pc->y) ^
+				     zobrist_key(ZOBRIST_DIR, dir, 0));
+}
+
+/* pc NULL means no food on the board */
+void zobrist_food(P_ZOBRIST pz, P_COORD pc)
+{
+	zobrist_set(pz, &pz->k_food, pc ? zobrist_key(ZOBRIST_FOOD, pc->x, pc->y) : 0);
+}
+
+/* Only the settings that change how the game plays out */
+void zobrist_settings(P_ZOBRIST pz, P_SETTINGS pset)
+{
+	zobrist_set(pz, &pz->k_settings, zobrist_key(ZOBRIST_SETTINGS,
+		    pset->portal | pset->reverse << 1 | pset->cheat << 2, 0));
+}
+
+/* Recompute the hash from scratch by walking every segment, for checking
+   the incremental one. pset and pfood may be NULL to leave them out.
+*/
+uint64_t snake_hash_full(P_SNAKE psnake, P_SETTINGS pset, P_FOOD pfood)
+{
+	ZOBRIST z = { 0, 0, 0, 0 };
+	P_SSEG pseg;
+	COORD c;
+	int i;
+
+	for(pseg = psnake->seg_head; pseg; pseg = pseg->next) {
+		c = pseg->coord_end;
+		for(i = 0; i < pseg->length; i++) {
+			zobrist_toggle(&z, &c);
+			seg_update_coord(pseg->dir, &c);
+		}
+	}
+
+	if(pset) {
+		zobrist_head(&z, &psnake->seg_head->coord_start, psnake->seg_head->dir);
+		zobrist_settings(&z, pset);
+	}
+	if(pfood && ! pfood->b_eaten) {
+		zobrist_food(&z, &pfood->coord);
+	}
+
+	return z.hash;
+}